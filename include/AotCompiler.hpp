@@ -0,0 +1,30 @@
+#ifndef AOTCOMPILER_HPP
+#define AOTCOMPILER_HPP
+
+#include <string>
+#include <CodeGen.hpp>
+
+/*
+ * Writes a compiled module as a native executable. The module, StdLib
+ * included, is emitted as an object file, and linked with Z3Runtime.a,
+ * which holds the OCaml runtime and the startup code of AotMain.cpp.
+ * The sections of the bytecode file the runtime needs are embedded in
+ * the module.
+ * A shared object can be written instead, whose symbols are resolved
+ * against Z3 when it is loaded, see CodeCache.
+ */
+class AotCompiler {
+    GenModule* Mod;
+
+    void emitObject(std::string Path);
+    bool link(std::string ObjPath, std::string Output, bool Shared);
+
+public:
+    AotCompiler(GenModule* Mod);
+    // Adds Bytes to the module as the global Name, and its size as NameSize
+    void embed(std::string Name, const std::string& Bytes);
+    // Returns false if the output could not be linked
+    bool emit(std::string Output, bool Shared = false);
+};
+
+#endif // AOTCOMPILER_HPP
@@ -0,0 +1,69 @@
+#ifndef BYTECODEOPTIMIZER_HPP
+#define BYTECODEOPTIMIZER_HPP
+
+#include <deque>
+#include <vector>
+#include <cstdint>
+
+#include <Instructions.hpp>
+
+// Number of stack slots whose value is followed by BytecodeOptimizer
+#define OPT_TRACKED_SLOTS 8
+
+/*
+ * Peephole optimizations of the instructions of a block, before they are
+ * lowered to IR:
+ *  - int constants are followed through the accumulator and the stack
+ *    slots, an ACC of a known slot becomes a CONSTINT
+ *  - other values are numbered, so that an ACC of a slot holding the
+ *    value already in the accumulator is removed
+ *  - int operations and comparisons on known values are folded, and
+ *    conditional branches on a known accumulator become a BRANCH or fall
+ *    through to the next block
+ *  - PUSH followed by POP or ACC0 and POP followed by POP are merged, and
+ *    instructions setting an accumulator overwritten before being read
+ *    are removed
+ * Nothing is known at block entry. The instructions of the stream are
+ * shared by the workers of ParallelCompiler and never modified: rewritten
+ * instructions are added to the storage of the function, and keep the
+ * offsets of the instruction they replace.
+ */
+class BytecodeOptimizer {
+    // Known int, or number of an unknown value, 0 if not followed
+    struct AbsVal {
+        bool Known;
+        int64_t Int;
+        int Id;
+        bool same(AbsVal Other);
+    };
+
+    // Accumulator and top of the stack, Slots[0] on top
+    struct State {
+        AbsVal Accu;
+        AbsVal Slots[OPT_TRACKED_SLOTS];
+        void push(AbsVal Val);
+        void pop(int n);
+        AbsVal slot(int n);
+        void step(ZInstruction* Inst, int& LastId);
+    };
+
+    std::deque<ZInstruction>& Storage;
+
+    // Instructions kept so far, and the state before each of them
+    std::vector<ZInstruction*> Out;
+    std::vector<State> States;
+    State Cur;
+    int LastId;
+
+    ZInstruction* make(ZInstruction* From, int OpNum, int32_t Arg = 0);
+    void emit(ZInstruction* Inst);
+    void dropLast();
+
+public:
+    BytecodeOptimizer(std::deque<ZInstruction>& Storage) : Storage(Storage), LastId(0) {}
+
+    // Returns true if the instructions changed
+    bool run(std::vector<ZInstruction*>& Instructions);
+};
+
+#endif // BYTECODEOPTIMIZER_HPP
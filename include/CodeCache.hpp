@@ -0,0 +1,31 @@
+#ifndef CODECACHE_HPP
+#define CODECACHE_HPP
+
+#include <string>
+#include <CodeGen.hpp>
+
+extern "C" {
+    #include <ocaml_runtime/mlvalues.h>
+}
+
+/*
+ * Cache of the native code of programs, in ~/.cache/z3.
+ *
+ * A program is keyed by a digest of the MD5 of its CODE section, of its
+ * PRIM section, of Z3_VERSION
+ * and of the options changing the generated code. Its code is stored as a
+ * shared object written by AotCompiler, and loaded with dlopen on the next
+ * runs, which then skip reading the instructions and compiling.
+ */
+class CodeCache {
+    std::string Path;
+
+public:
+    CodeCache(const unsigned char* CodeDigest, const std::string& Prims, const std::string& Options);
+    // Entry of the cached program, or null on a miss
+    void (*load())();
+    // Writes the fully generated module to the cache, returns false on failure
+    bool store(GenModule* Mod);
+};
+
+#endif // CODECACHE_HPP
@@ -4,6 +4,7 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
 #include <deque>
 #include <sstream>
 
@@ -13,13 +14,16 @@
 #include "llvm/PassManager.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
 #include <Instructions.hpp>
+#include <Profile.hpp>
 
 #define MAIN_FUNCTION_ID 0
 
 class GenModule;
 class GenFunction;
+class JitEngine;
 
 class CodeGen {
 public:
@@ -33,48 +37,129 @@ inline void printTab(int nbTabs) {
 
 // ================ GenBlock Declaration ================== //
 
-struct ClosureInfo {
-    llvm::Function* LlvmFunc;
-    bool IsBare;
-};
-
+// A slot of the virtual ZAM stack. A dirty slot has not been written
+// to the memory stack yet.
 struct StackValue {
     llvm::Value* Val;
-    StackValue(llvm::Value* Val) {this->Val = Val;}
+    bool Dirty;
+    StackValue(llvm::Value* Val, bool Dirty=false) {this->Val = Val; this->Dirty = Dirty;}
+};
+
+// Key used in PrevStackCache and PHINodes for the accumulator
+#define ACCU_KEY -1
+
+// Max number of stack slots tracked by StackState
+#define MAX_TRACKED_SLOTS 64
+
+// Abstract values of the stack analysis.
+// Positive values are closures of the GenFunction with that id
+#define ABS_UNKNOWN -2
+#define ABS_INT -1
+
+// Abstract ZAM state, used to find the stack slots and accumulator
+// values that always hold immediate ints or a known closure
+struct StackState {
+    // Slots[0] is the top of the stack, untracked slots are unknown
+    std::deque<int> Slots;
+    int Accu;
+    bool Visited;
+
+    // Handlers of the enclosing try blocks, the innermost one last
+    std::vector<int> Traps;
+
+    StackState() : Accu(ABS_UNKNOWN), Visited(false) {}
+    int slot(int n) { return n >= 0 && (size_t)n < Slots.size() ? Slots[n] : ABS_UNKNOWN; }
+    void push(int Val);
+    void pop(int n);
+    void step(ZInstruction* Inst, GenFunction* Function);
+    bool meet(StackState& Other);
+};
+
+// Values kept in registers across a call that can trigger the GC.
+// Keys are the stack slots or ACCU_KEY the first values come from.
+struct GCRoots {
+    std::vector<int> Keys;
+    std::vector<llvm::Value*> Vals;
+    llvm::Value* Prev;
 };
 
 class GenBlock : public CodeGen {
     friend class GenModuleCreator;
     friend class GenFunction;
+    friend class MixedEngine;
+    friend class ParallelCompiler;
 
 private:
     int Id;
     GenFunction* Function;
     llvm::IRBuilder<> * Builder;
 
+    // Position in the blocks of the function, and in a postorder of the
+    // CFG from its first block
+    int Index;
+    int PostIndex;
+
+    // Immediate dominator, null for the first block
+    GenBlock* Idom;
+    bool dominates(GenBlock* Other);
+
+    // Header of the innermost natural loop containing the block or null,
+    // and number of loops containing it
+    GenBlock* LoopHeader;
+    int LoopDepth;
+
     // Siblings blocks handling
-    std::list<GenBlock*> PreviousBlocks;
-    std::list<GenBlock*> NextBlocks;
+    std::vector<GenBlock*> PreviousBlocks;
+    std::vector<GenBlock*> NextBlocks;
     GenBlock* BrBlock;
     GenBlock* NoBrBlock;
 
-    void makeCheckedCall(llvm::Value* callee, llvm::ArrayRef<llvm::Value*> Args);
-
-
-    // List of PhiNodes to fill at the end of function codegen
+    // List of PhiNodes to fill at the end of function codegen.
+    // The int is the stack slot at block entry, or ACCU_KEY
     std::list<std::pair<llvm::PHINode*, int>> PHINodes;
     void genTermInst();
+    bool fillPHINodes();
 
     // Instructions to generate
     std::vector<ZInstruction*> Instructions;
 
     // Stack handling
+    // Stack[0] is the top of the virtual stack, null entries are slots
+    // whose value is not known yet
     std::deque<StackValue*> Stack;
-    std::map<int, StackValue*> PrevStackCache;
+    // Values coming from the predecessors, indexed by stack slot at
+    // block entry. Those are phi nodes, or the tagged value of an
+    // untagged phi node
+    std::map<int, llvm::Value*> PrevStackCache;
     llvm::Value* Accu;
+    bool AccuDirty;
     llvm::Value* ExtraArgs;
-    llvm::Value* getAccu(bool CreatePhi=true);
+    // Value of StackPointer in memory, or null if it has to be reloaded
     llvm::Value* Sp;
+    // Distance in words between the virtual stack top and Sp
+    int StackOffset;
+    // Distance in words between Sp and the stack pointer at block entry
+    int EntryShift;
+    // True as long as the memory stack was not touched by a helper call,
+    // ie. values below the virtual stack are the ones of block entry
+    bool AtEntry;
+    // Set for exception handlers, which are entered from a longjmp
+    bool IsTrapHandler;
+    // Liveness of the accumulator at block boundaries
+    bool AccuLiveIn;
+    bool AccuLiveOut;
+    // Abstract stack at block boundaries, and before the
+    // instruction being generated
+    StackState EntryState;
+    StackState ExitState;
+    StackState CurState;
+
+    bool canJoinPreds();
+    bool isIntKey(int Key);
+    llvm::Value* getEntryPhi(int Key);
+    llvm::Value* getExitValue(int Key);
+    void syncStack(bool AtExit=false);
+    void invalidateStack();
 
     // Llvm block handling
     std::pair<llvm::BasicBlock*, llvm::BasicBlock*> addBlock();
@@ -86,10 +171,6 @@ private:
     // containing the result of the test
     llvm::Value* CondVal;
 
-    std::map<StackValue*, StackValue*> MutatedVals;
-
-    llvm::Value* createArrayFromStack(size_t Size);
-
 public:
     GenBlock(int Id, GenFunction* Function);
     void setNext(GenBlock* Block, bool IsBrBlock);
@@ -103,33 +184,81 @@ public:
     void pushAcc(int n);
     void acc(int n);
     void envAcc(int n);
-    void push(bool CreatePhi=true);
+    void push();
+    void pushValue(llvm::Value* Val);
+    void pop(int n);
+    void assign(int n);
     void makeOffsetClosure(int32_t n);
     void makeSetField(size_t n);
     void makeGetField(size_t n);
+
+    // Inline minor heap allocation
+    llvm::Value* makeAlloc(size_t WoSize, int Tag);
+    void storeField(llvm::Value* Block, size_t n, llvm::Value* Val);
+    void makeBlockAlloc(size_t WoSize, int Tag);
+    void makeGetFloatField(size_t n);
+    void makeClosure(int NVars, int FnId);
+    void makeClosureRec(ZInstruction* Inst);
+
+    // GC roots for values held in registers
+    bool isPointerVal(llvm::Value* Val);
+    llvm::Value* getRootedVal(int Key);
+    void setRootedVal(int Key, llvm::Value* Val);
+    GCRoots saveRoots(bool WithAccu, llvm::ArrayRef<llvm::Value*> Extra = llvm::ArrayRef<llvm::Value*>());
+    void restoreRoots(GCRoots& Roots);
+    llvm::Value* makeCall(std::string FuncName, llvm::ArrayRef<llvm::Value*> Args);
     llvm::Value* makeCall0(std::string FuncName);
     llvm::Value* makeCall1(std::string FuncName, llvm::Value* arg1);
     llvm::Value* makeCall2(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2);
     llvm::Value* makeCall3(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2, llvm::Value* arg3);
     llvm::Value* makeCall4(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2, llvm::Value* arg3, llvm::Value* arg4);
     llvm::Value* makeCall5(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2, llvm::Value* arg3, llvm::Value* arg4, llvm::Value* arg5);
+    llvm::Instruction* createCall(llvm::Value* Callee, llvm::ArrayRef<llvm::Value*> Args, bool FastCC = false);
+    bool inTryBlock();
     void debug(llvm::Value* DbgVal);
-    void makeBoolToIntCast();
     void addCallInfo();
 
-    size_t StackOffset;
+    // Profile instrumentation and use, see Profile
+    void countExecution(Profile::Kind K, int32_t Offset);
+    bool isCold();
+    bool isColdSite(ZInstruction* Inst);
+    void markColdCalls(size_t FirstBlock = 0, size_t FirstInst = 0);
+    void setBranchWeights(llvm::Instruction* Br, GenBlock* TrueBlock, GenBlock* FalseBlock);
+
+    // Calls using the native calling convention
+    GenFunction* getNativeTarget(int NArgs);
+    void makeNativeCall(GenFunction* Target, int NArgs, int FrameSize);
+    void makeNativeTailCall(GenFunction* Target, int NArgs, int SlotSize);
+    void makeSelfTailCall(int NArgs, int SlotSize);
+    void makeNativeApplyTerm(int NArgs, int SlotSize);
+    void makeReturn();
+
+    llvm::Value* getAccu();
+    llvm::Value* getCond();
+    void setAccu(llvm::Value* Val);
+    llvm::Value* getSp();
     llvm::Value* getStackAt(size_t n);
+    llvm::GlobalVariable* getGlobalVariable(std::string Name);
+    void makeGetGlobal(int32_t n);
 
     llvm::Value* intVal(llvm::Value* From);
     llvm::Value* valInt(llvm::Value* From);
+    bool hasUntagged(llvm::Value* Val);
+    llvm::Value* getUntagged(llvm::Value* Val);
+    void setIntAccu(llvm::Value* Result);
     llvm::Value* castToInt(llvm::Value* Val);
-    llvm::Value* castToVal(llvm::Value* Val);
-    llvm::Value* castToBool(llvm::Value* Val);
     llvm::Value* castToPtr(llvm::Value* Val);
 
+    // Inline integer arithmetic
+    void makeIntOp(ZInstruction* Inst);
+    void makeIntCmp(ZInstruction* Inst);
+    void makeDivOp(ZInstruction* Inst);
+
     // Function getters
     llvm::Function* getFunction(std::string FuncName);
     llvm::Value* getPtrToFunc(int32_t FnId);
+    GenFunction* getKnownTarget();
+    llvm::Value* getCallee(llvm::Value* CodePtr);
 
 };
 
@@ -143,31 +272,98 @@ class GenFunction : public CodeGen {
     friend class GenModuleCreator;
     friend class GenModule;
     friend class GenBlock;
+    friend class MixedEngine;
+    friend class ParallelCompiler;
+    friend struct StackState;
 
 private:
     int Id;
     int Arity;
+    // Offset of the entry in the code
+    int32_t CodeOffset;
 
-    std::map<int, GenBlock*> Blocks;
+    // Blocks in bytecode order, and headers of the natural loops
+    std::vector<GenBlock*> Blocks;
+    std::vector<GenBlock*> LoopHeaders;
     GenBlock* FirstBlock;
     GenModule* Module;
+    GenBlock* blockAt(int Idx);
+    void computeDominators();
+    void computeLoops();
 
-    // Map closures to llvm Functions to keep track of signatures
-    std::map<llvm::Value*, ClosureInfo> ClosuresFunctions;
+    // Instructions rewritten by BytecodeOptimizer, referenced by the
+    // blocks instead of the ones of the stream
+    std::deque<ZInstruction> Rewritten;
 
+    // Functions of the CLOSUREREC instruction creating this function,
+    // and index of this function among them
+    std::vector<int> RecGroup;
+    int RecIndex;
+
+    // Tagged booleans created from comparisons, mapped to the
+    // i1 value of the comparison
     std::map<llvm::Value*, llvm::Value*> BoolsAsVals;
 
+    // Tagged ints mapped to the untagged value they were made from
+    std::map<llvm::Value*, llvm::Value*> UntaggedVals;
+
+    // Table of GC roots in the function frame, and the
+    // caml__roots_block registering it
+    llvm::AllocaInst* RootSlots;
+    llvm::AllocaInst* RootsBlock;
+    size_t MaxRoots;
+    llvm::Value* getRootSlots(size_t N);
+    llvm::Value* getRootsBlock();
+
+    // Landing pads of the exception handlers, by handler block
+    std::map<int, llvm::BasicBlock*> LandingPads;
+    llvm::BasicBlock* getLandingPad(int HandlerId);
+
+    void computeAccuLiveness();
+    void computeStackStates();
+    int closureAtOffset(int Offset);
+
     void generateRestartFunction();
+    void generateZamEntry();
+
+    void inlineHelpers(llvm::Function* F);
+    void promoteRegisters(llvm::Function* F);
 
 public:
     llvm::Function* RestartFunction;
     llvm::Function* LlvmFunc;
+
+    // Entry taking the environment and the arguments as parameters and
+    // returning the result, used by calls with the exact arity. When it
+    // exists, the body is generated in it and LlvmFunc only handles the
+    // ZAM stack protocol before calling it.
+    llvm::Function* NativeFunc;
+    bool Native;
+
+    // Block holding the allocas, that branches to the first block. The
+    // parameters of the native entry are PHI nodes of the first block,
+    // self tail calls jump back to it with new ones.
+    llvm::BasicBlock* EntryBlock;
+    std::vector<llvm::PHINode*> NativeParams;
+
+    bool Generated;
     GenFunction(int Id, GenModule* Module);
+    llvm::Function* getLlvmFunc();
+    llvm::Function* getNativeFunc();
+    bool hasNativeEntry();
+    void optimize();
+    int32_t codeOffset();
+    size_t blockCount() { return Blocks.size(); }
+    size_t loopCount() { return LoopHeaders.size(); }
+    size_t rewrittenCount() { return Rewritten.size(); }
+    llvm::Constant* getClosureCode(bool Restart = false);
     std::string name();
     void Print(); 
     void PrintBlocks(); 
     llvm::Function* CodeGen();
-    void removeUnusedBlocks();
+
+    // Register promotion of the VM registers
+    void promoteRegisters();
 };
 
 
@@ -178,6 +374,19 @@ class GenModule : public CodeGen {
     friend class GenModuleCreator;
     friend class GenFunction;
     friend class GenBlock;
+    friend class FunctionMaterializer;
+
+
+    // StdLib, read lazily from the bitcode embedded in Z3. Its globals are
+    // imported in TheModule when they are first referenced, and the bodies
+    // of its functions when they are materialized.
+    llvm::Module* StdLibModule;
+    // StdLib globals mapped to their copy in TheModule
+    llvm::ValueToValueMapTy StdLibValues;
+    // Imported functions whose body was not copied yet
+    std::map<llvm::Function*, llvm::Function*> StdLibDecls;
+    llvm::Constant* importValue(llvm::GlobalValue* StdLibValue);
+    void importOperands(llvm::User* Val);
 
 public:
 
@@ -185,13 +394,36 @@ public:
     std::map<int, GenFunction*> Functions;
 
     llvm::FunctionPassManager* FPM;
-    llvm::PassManager* PM;
     llvm::Module *TheModule;
     llvm::IRBuilder<> * Builder;
-    llvm::ExecutionEngine* ExecEngine;
-
-    GenModule();
+    JitEngine* ExecEngine;
+
+    // Functions of TheModule defined in StdLib
+    std::set<llvm::Function*> StdLibFunctions;
+
+    // GenFunction owning each ZAM and native entry. Their code is
+    // generated when the JIT first needs it, see FunctionMaterializer.
+    std::map<const llvm::Function*, GenFunction*> GenFunctions;
+    bool Locals;
+    // Level of the passes compileFunction runs, see setOptLevel
+    int OptLevel;
+    // Closures hold bytecode pointers, see MixedEngine
+    bool Mixed;
+    // Counts written by the generated code, and counts of a previous run
+    // used to generate it, when not null
+    Profile* ProfileGen;
+    Profile* ProfileUse;
+
+    // Modules that are not run only have no ExecEngine
+    GenModule(bool Jit = true);
     llvm::Function* getFunction(std::string FuncName);
+    llvm::GlobalVariable* getGlobalVariable(std::string Name);
+    bool isStdLibDecl(const llvm::GlobalValue* GV);
+    void materializeHelper(llvm::Function* Func);
+    void resolveStdLib();
+    bool isInlinableHelper(llvm::Function* Func);
+    void setOptLevel(int Level);
+    void compileFunction(GenFunction* Func);
     void Print(); 
 };
 
@@ -204,19 +436,47 @@ private:
     std::vector<ZInstruction*>* OriginalInstructions;
     GenModule* Module;
 
+    // Range of OriginalInstructions generated
+    int FirstInst;
+    int LastInst;
+
+    // Position in OriginalInstructions of each instruction index,
+    // -1 outside of the range
+    std::vector<int32_t> Positions;
+    // Function owning the instruction at each position, -1 for dead code
+    std::vector<int32_t> Owners;
+    // Positions starting a block, and the block starting there
+    std::vector<bool> Leaders;
+    std::vector<GenBlock*> BlockStarts;
+    // Whether each function can be called, see ReachabilityAnalysis
+    std::vector<bool> LiveFunctions;
+
+    int positionOf(int32_t Idx);
+    void markFunction(int Entry);
+    bool isDeadClosure(ZInstruction* Inst);
+    void addDeadClosure(GenFunction* Function, ZInstruction* Inst, std::vector<ZInstruction*>& Instructions);
+    void removeUnreachableBlocks(GenFunction* Function);
+
 public:
+    // Functions dropped by the last generate
+    size_t DeadFunctions;
 
-    GenModuleCreator(std::vector<ZInstruction*>* Instructions) { 
+    GenModuleCreator(std::vector<ZInstruction*>* Instructions, bool Jit = true) { 
         this->OriginalInstructions = Instructions; 
-        Module = new GenModule();
+        this->DeadFunctions = 0;
+        Module = new GenModule(Jit);
     }
 
     GenModule* generate(int FirstInst=0, int LastInst=0);
-    std::deque<ZInstruction*>* initFunction(std::deque<ZInstruction*>* Instructions);
-    void generateFunction(GenFunction* Function, std::deque<ZInstruction*>* Instructions);
+    void generateFunction(GenFunction* Function, int Entry, const std::vector<int32_t>& FuncPositions);
 };
 
-inline llvm::Type* getValType();
+llvm::Type* getValType();
 llvm::Type* getBoolType(); 
 
+// Context code is generated in. It is set per thread by the workers of
+// ParallelCompiler, and is the global context otherwise.
+llvm::LLVMContext& getCodeGenContext();
+void setCodeGenContext(llvm::LLVMContext* Context);
+
 #endif // CODEGEN_HPP
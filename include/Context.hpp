@@ -1,27 +1,51 @@
 #include <Instructions.hpp>
 #include <CodeGen.hpp>
+#include <CodeCache.hpp>
 #include <string>
 
 class Context {
     std::string FileName;
-    GenModule* Mod;
+    GenModule* Mod = nullptr;
+
+    CodeCache* Cache = nullptr;
+    void (*CachedProgram)() = nullptr;
+
+    // Sections of the bytecode file embedded in AOT executables
+    std::string Data, Prims, SharedLibPath, SharedLibs;
 
 protected:
+    InstructionStream Stream;
     std::vector<ZInstruction*> Instructions;
 
 public:
     virtual ~Context() {};
     void init(std::string FileName, int EraseFrom, int EraseFirst, int EraseLast);
     virtual void generateMod();
-    virtual void compile();
+    virtual void compile(bool Lazy = true);
     void exec(bool PrintTime);
-    bool Opt = false;
+    void aot(std::string Output);
+    // Optimization level, 0 or 1
+    int OptLevel = 0;
+    bool Locals = false;
+    // Run in the interpreter, compiling the hot functions
+    bool Mixed = false;
+    int Threshold = 1000;
+    // Threads generating the functions, they are all generated up front
+    // when there are several
+    int Threads = 1;
+    // Run the program from the code cache, storing it there on a miss
+    bool UseCache = false;
+    // Profile recorded by the generated code and written at exit, and
+    // profile of a previous run used to generate it, see Profile
+    std::string ProfileGenPath;
+    std::string ProfileUsePath;
+    bool cached() { return CachedProgram != nullptr; }
 
 };
 
 class SimpleContext : public Context {
 public:
     void generateMod();
-    void compile();
+    void compile(bool Lazy = true);
     void exec();
 };
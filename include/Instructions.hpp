@@ -5,11 +5,7 @@
 #include <fstream>
 #include <vector>
 #include <list>
-#include <map>
 #include <string>
-#include <iostream>
-#include <boost/assign/list_of.hpp>
-#include <map>
 
 #include <EndianUtils.hpp>
 
@@ -179,73 +175,112 @@ enum OpCodes {
         type,
     OPCODE_NODE_LIST(DEFINE_ENUM)
     #undef DEFINE_ENUM
+    NB_OPCODES
 };
 
 /**
- * Structure of a basic opcode, 
- * containing it's name and arity (number of arguments)
+ * Name and arity (number of arguments) of every opcode
  */
-struct OpCode {
-    const char Name[32];
-    unsigned short Arity;
+constexpr const char* OpNames[] = {
+    #define DEFINE_NAME(type, arity) \
+        #type,
+    OPCODE_NODE_LIST(DEFINE_NAME)
+    #undef DEFINE_NAME
+};
+
+constexpr unsigned char OpArities[] = {
+    #define DEFINE_ARITY(type, arity) \
+        arity,
+    OPCODE_NODE_LIST(DEFINE_ARITY)
+    #undef DEFINE_ARITY
 };
 
+// Max number of arguments of an opcode
+#define MAX_ARGS 2
+
+constexpr bool aritiesFit(int Op = 0) {
+    return Op == NB_OPCODES || (OpArities[Op] <= MAX_ARGS && aritiesFit(Op + 1));
+}
+static_assert(aritiesFit(), "An opcode has more than MAX_ARGS arguments");
+
 /**
- * Array containing every opcode's name and arity
+ * Index of the argument of the opcode that is a code offset, or -1
  */
-static OpCode AllOpCodes[146] = {
-    #define DEFINE_OPCODES(type, arity) \
-        {#type, arity},
-    OPCODE_NODE_LIST(DEFINE_OPCODES)
-    #undef DEFINE_OPCODES
+constexpr int codeOffsetArg(int Op) {
+    return (Op == PUSH_RETADDR || Op == BRANCH || Op == BRANCHIF
+            || Op == BRANCHIFNOT || Op == PUSHTRAP) ? 0
+        : (Op == CLOSURE || Op == BEQ || Op == BNEQ || Op == BLTINT || Op == BLEINT
+           || Op == BGTINT || Op == BGEINT || Op == BULTINT || Op == BUGEINT) ? 1
+        : -1;
+}
 
+constexpr signed char OpCodeOffsetArgs[] = {
+    #define DEFINE_CODE_OFFSET_ARG(type, arity) \
+        codeOffsetArg(type),
+    OPCODE_NODE_LIST(DEFINE_CODE_OFFSET_ARG)
+    #undef DEFINE_CODE_OFFSET_ARG
 };
 
 enum InstrAnnotation {
     NOTHING, FUNCTION_START, BLOCK_START
 };
 
+/**
+ * Number of words following the arguments of CLOSUREREC (the offsets of
+ * its functions) and SWITCH (the offsets of its cases)
+ */
+inline int32_t payloadSize(uint32_t OpNum, int32_t Arg0) {
+    switch (OpNum) {
+        case CLOSUREREC: return Arg0;
+        case SWITCH: return (Arg0 >> 16) + (Arg0 & 0xFFFF);
+        default: return 0;
+    }
+}
 
-
-static std::map<int, int> CodeOffsetArgs =boost::assign::map_list_of 
-( PUSH_RETADDR, 0)
-( CLOSURE, 1)
-( BRANCH, 0)
-( BRANCHIF, 0)
-( BRANCHIFNOT, 0)
-( PUSHTRAP, 0)
-   ( BEQ, 1)
-   ( BNEQ, 1)
-   ( BLTINT, 1)
-   ( BLEINT, 1)
-   ( BGTINT, 1)
-   ( BGEINT, 1)
-   ( BULTINT, 1)
-   ( BUGEINT, 1);
-
-
+/**
+ * Variable length operands of an instruction
+ */
+struct Operands {
+    int32_t* First;
+    int32_t* Last;
+
+    int32_t* begin() const { return First; }
+    int32_t* end() const { return Last; }
+    size_t size() const { return Last - First; }
+    int32_t operator[](size_t i) const { return First[i]; }
+    int32_t back() const { return Last[-1]; }
+};
 
 /**
- * Struct representing a concrete instruction in a bytecode file
+ * Struct representing a concrete instruction in a bytecode file.
+ * Instructions live in an InstructionStream.
  */
 struct ZInstruction {
 public:
-    uint32_t OpNum;
-    int32_t Args[4];
+    uint16_t OpNum;
+    uint16_t Annotation;
+    int32_t Args[MAX_ARGS];
     int32_t idx;
     int32_t OrigIdx;
-    int32_t ClosureRecFns[32];
-    std::vector<int32_t> SwitchEntries;
-    uint32_t Annotation;
+    // Functions of a CLOSUREREC, or cases of a SWITCH, as instruction
+    // indexes in the side table of the stream
+    int32_t* Payload;
 
     inline unsigned short Arity() {
-        return AllOpCodes[OpNum].Arity;
+        return OpArities[OpNum];
     }
 
     inline const char* Name() {
-        return AllOpCodes[OpNum].Name;
+        return OpNames[OpNum];
+    }
+
+    inline Operands payload() {
+        return Operands{Payload, Payload + payloadSize(OpNum, Args[0])};
     }
 
+    inline Operands closureRecFns() { return payload(); }
+    inline Operands switchEntries() { return payload(); }
+
     inline void Print(bool LineNums = false) {
         if (LineNums) std::cout << idx << ": ";
         std::cout << Name() << " ";
@@ -253,11 +288,11 @@ public:
         for (int i = 0; i < Arity(); i++) std::cout << Args[i] << " ";
 
         if (this->isClosureRec())
-            for (int i = 0; i < Args[0]; i++) 
-                std::cout << this->ClosureRecFns[i] << " ";
+            for (auto Fn : closureRecFns())
+                std::cout << Fn << " ";
         
         if (this->isSwitch())
-            for (auto SwEnt : SwitchEntries)
+            for (auto SwEnt : switchEntries())
                 std::cout << SwEnt << " ";
 
         std::cout << std::endl;
@@ -306,6 +341,22 @@ public:
         return OpNum == PUSHTRAP;
     }
 
+    inline bool isApply() {
+        switch (OpNum) {
+            case APPLY:
+            case APPLY1:
+            case APPLY2:
+            case APPLY3:
+            case APPTERM:
+            case APPTERM1:
+            case APPTERM2:
+            case APPTERM3:
+                return true;
+            default:
+                return false;
+        }
+    }
+
     inline bool isReturn() {
         switch (OpNum) {
             case RAISE:
@@ -321,22 +372,117 @@ public:
         }
     }
 
+    /**
+     * True for the PUSH* instructions, that push the accumulator
+     * before doing the operation of their non push version
+     */
+    inline bool pushesAccu() {
+        switch (OpNum) {
+            case PUSH:
+            case PUSHACC0: case PUSHACC1: case PUSHACC2: case PUSHACC3:
+            case PUSHACC4: case PUSHACC5: case PUSHACC6: case PUSHACC7: case PUSHACC:
+            case PUSHENVACC1: case PUSHENVACC2: case PUSHENVACC3:
+            case PUSHENVACC4: case PUSHENVACC:
+            case PUSHOFFSETCLOSUREM2: case PUSHOFFSETCLOSURE0:
+            case PUSHOFFSETCLOSURE2: case PUSHOFFSETCLOSURE:
+            case PUSHGETGLOBAL: case PUSHGETGLOBALFIELD:
+            case PUSHATOM0: case PUSHATOM:
+            case PUSHCONST0: case PUSHCONST1: case PUSHCONST2:
+            case PUSHCONST3: case PUSHCONSTINT:
+            case GETPUBMET:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Variation of the stack size caused by the instruction, in words.
+     * For calls, this is the variation once the callee returned.
+     */
+    int stackEffect();
+
+    /**
+     * True if the instruction overwrites the accumulator
+     * without reading it first
+     */
+    inline bool overwritesAccu() {
+        switch (OpNum) {
+            case ACC0: case ACC1: case ACC2: case ACC3:
+            case ACC4: case ACC5: case ACC6: case ACC7: case ACC:
+            case ENVACC1: case ENVACC2: case ENVACC3: case ENVACC4: case ENVACC:
+            case CONST0: case CONST1: case CONST2: case CONST3: case CONSTINT:
+            case GETGLOBAL:
+            case ATOM0: case ATOM:
+            case OFFSETCLOSUREM2: case OFFSETCLOSURE0:
+            case OFFSETCLOSURE2: case OFFSETCLOSURE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * True if the instruction neither reads nor writes the accumulator
+     */
+    inline bool ignoresAccu() {
+        switch (OpNum) {
+            case POP:
+            case PUSH_RETADDR:
+            case POPTRAP:
+            case BRANCH:
+            case CHECK_SIGNALS:
+                return true;
+            default:
+                return false;
+        }
+    }
+
     inline bool hasCodeOffset() {
-        bool hasCodeOff = (CodeOffsetArgs.find(OpNum) != CodeOffsetArgs.end());
-        return hasCodeOff;
+        return OpCodeOffsetArgs[OpNum] >= 0;
     }
 
-    inline bool getCodeOffsetArgIdx() {
-        return CodeOffsetArgs.find(this->OpNum)->second;
+    inline int getCodeOffsetArgIdx() {
+        return OpCodeOffsetArgs[OpNum];
     }
 
     inline int getDestIdx() {
-        return Args[CodeOffsetArgs[OpNum]];
+        return Args[OpCodeOffsetArgs[OpNum]];
     }
 
 };
 
-void readInstructions(std::vector<ZInstruction*>& Instructions, int32_t* TabInst, uint32_t Size);
+/**
+ * Storage of the decoded program. The instructions are in one array, in
+ * bytecode order, and the variable length operands of CLOSUREREC and
+ * SWITCH in a side table. Both are allocated once, at their final size,
+ * so that pointers to the instructions stay valid.
+ *
+ * scan only finds where the instructions start. Their arguments are then
+ * read by decode, from the code the stream was scanned from.
+ *
+ * This is still an array of structs, about 47 bytes per instruction with
+ * the side tables. Parallel opcode/argument/offset arrays take half that
+ * but every pass reads the instructions through ZInstruction pointers.
+ */
+class InstructionStream {
+    int32_t* Code;
+
+public:
+    std::vector<ZInstruction> Insts;
+    std::vector<int32_t> Payloads;
+    // Index of the instruction starting at each word of the code, -1 for
+    // the words holding arguments
+    std::vector<int32_t> IndexOfWord;
+
+    // Size in bytes
+    void scan(int32_t* Code, uint32_t Size);
+    void decode();
+    int32_t indexOfTarget(int32_t Word);
+};
+
+void readInstructions(InstructionStream& Stream, std::vector<ZInstruction*>& Instructions,
+                      int32_t* TabInst, uint32_t Size);
 
 inline void printInstructions(std::vector<ZInstruction*>& Instructions, bool LineNums=true) {
     for (uint32_t i = 0; i < Instructions.size(); i++) {
@@ -0,0 +1,39 @@
+#ifndef JITENGINE_HPP
+#define JITENGINE_HPP
+
+#include <vector>
+#include <CodeGen.hpp>
+#include <Timing.hpp>
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+/*
+ * Execution engine of the generated code: the LLVM JIT, with all the
+ * functions in TheModule, emitting a function on its first call through a
+ * lazy stub. Symbols missing from TheModule are resolved against the OCaml
+ * runtime and its primitives. The IR of the generated functions is freed
+ * once they are emitted.
+ */
+class JitEngine : public llvm::JITEventListener {
+    GenModule* Mod;
+    llvm::ExecutionEngine* Engine;
+
+    // Generated functions emitted since the last call to freeEmittedIR
+    std::vector<llvm::Function*> Emitted;
+    // Start of the emission of the next function, for -t
+    Timing::Clock EmitStart;
+
+public:
+    JitEngine(GenModule* Mod);
+    void* getPointerToFunction(llvm::Function* Func);
+    void* getPointerToGlobal(llvm::GlobalValue* Global);
+    const llvm::TargetData* getTargetData();
+
+    // Must not be called while the JIT emits a function
+    void freeEmittedIR();
+    void startEmission();
+
+    void NotifyFunctionEmitted(const llvm::Function& Func, void* Code, size_t Size,
+                               const EmittedFunctionDetails& Details);
+};
+
+#endif // JITENGINE_HPP
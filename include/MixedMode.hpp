@@ -0,0 +1,55 @@
+#ifndef MIXEDMODE_HPP
+#define MIXEDMODE_HPP
+
+#include <unordered_map>
+#include <CodeGen.hpp>
+
+extern "C" {
+    #include <ocaml_runtime/mlvalues.h>
+}
+
+/*
+ * Mixed mode execution. The program runs in the bytecode interpreter of
+ * the OCaml runtime, and a function is compiled once its calls and loop
+ * iterations reach the threshold.
+ *
+ * Closures always hold bytecode pointers. The interpreter hook redirects
+ * the entry of a compiled function to a bytecode stub calling its code,
+ * and generated code maps the code pointers of closures to the compiled
+ * code, or to the interpreter.
+ */
+class MixedEngine {
+
+    struct FunctionInfo {
+        GenFunction* Func;
+        // Calls and loop iterations in the interpreter
+        int Count;
+        // Compiled code, and bytecode stub calling it
+        void* ZamEntry;
+        void* RestartEntry;
+        code_t Stub;
+        code_t StubEntry;
+    };
+
+    GenModule* Mod;
+    int Threshold;
+
+    // Functions by bytecode entry and RESTART instruction
+    std::unordered_map<code_t, FunctionInfo*> Entries;
+    // Functions by instruction following one of their CHECK_SIGNALS
+    std::unordered_map<code_t, FunctionInfo*> LoopHeads;
+
+    void* InterpApply;
+    int JitEnterPrim;
+
+    void compile(FunctionInfo* Info);
+    void makeStub(FunctionInfo* Info);
+
+public:
+    MixedEngine(GenModule* Mod, int Threshold);
+    code_t onInterpEntry(code_t Pc);
+    void* onJitApply(code_t Code);
+    value run();
+};
+
+#endif // MIXEDMODE_HPP
@@ -0,0 +1,35 @@
+#ifndef PARALLELCOMPILER_HPP
+#define PARALLELCOMPILER_HPP
+
+#include <string>
+#include <vector>
+#include <CodeGen.hpp>
+
+/*
+ * Generates and optimizes all the functions of a module on several threads.
+ *
+ * LLVM contexts are not thread safe, so each worker builds its own
+ * GenModule from the instructions, in its own context, and only generates
+ * its share of the functions. The other ones are declarations. The worker
+ * modules are then written as bitcode, read back in the global context and
+ * linked into the module that is run.
+ */
+class ParallelCompiler {
+    GenModule* Mod;
+    std::vector<ZInstruction*>* Instructions;
+    int Threads;
+
+    // Ids of the functions generated by each worker, and its module
+    std::vector<std::vector<int>> Partitions;
+    std::vector<std::string> Bitcodes;
+
+    void partition();
+    void compilePartition(int Worker);
+    void link(int Worker);
+
+public:
+    ParallelCompiler(GenModule* Mod, std::vector<ZInstruction*>* Instructions, int Threads);
+    void run();
+};
+
+#endif // PARALLELCOMPILER_HPP
@@ -0,0 +1,39 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <cstdint>
+
+/*
+ * Execution counts of a program, keyed by bytecode offset (OrigIdx).
+ *
+ * With --profile-gen, the generated code increments a counter at the start
+ * of each GenBlock, keyed by the offset of its first instruction, and at
+ * each APPLY and APPTERM site, keyed by the offset of the instruction. The
+ * counts are written at exit, one "<kind> <offset> <count>" line each.
+ * With --profile-use, they drive branch weights, helper inlining and the
+ * placement of the cold blocks.
+ */
+class Profile {
+public:
+    enum Kind { BLOCK = 'B', APPLY = 'A' };
+
+    // Counter incremented by the generated code. Counters are never moved,
+    // and may be created by the workers of ParallelCompiler.
+    uint64_t* counter(Kind K, int32_t Offset);
+
+    bool has(Kind K, int32_t Offset);
+    uint64_t count(Kind K, int32_t Offset);
+
+    // Return false if the file could not be read or written
+    bool load(const std::string& Path);
+    bool save(const std::string& Path);
+
+private:
+    std::map<std::pair<char, int32_t>, uint64_t> Counts;
+    std::mutex Lock;
+};
+
+#endif // PROFILE_HPP
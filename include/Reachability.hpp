@@ -0,0 +1,89 @@
+#ifndef REACHABILITY_HPP
+#define REACHABILITY_HPP
+
+#include <map>
+#include <vector>
+#include <cstdint>
+
+#include <Instructions.hpp>
+
+/*
+ * Functions of the program that can be called, as ocamlclean finds them.
+ *
+ * The initialization code of the modules, in the main function, creates
+ * the closures of every function and stores them in the global of their
+ * module, whether the program uses them or not. The values of main are
+ * followed through the accumulator, its stack, the blocks it makes and
+ * SETGLOBAL. A closure whose value is used in any other way escapes, and
+ * its function is reachable. A reachable function is scanned for the
+ * globals and global fields it reads, which escape, and for the closures
+ * it creates, which are reachable.
+ * A closure that only ends up in global fields read by no reachable code
+ * can never be called.
+ *
+ * Values are followed in one pass over main, in bytecode order. Values
+ * that are replaced in a stack slot, joined with different values, or
+ * that flow back to an instruction already visited escape.
+ */
+class ReachabilityAnalysis {
+    // Abstract value: a closure of some functions or a block, with the
+    // values of its environment or of its fields. Value 0 holds no
+    // closure that did not escape yet.
+    struct Value {
+        bool IsBlock;
+        bool Escaped;
+        std::vector<int> Fns;
+        std::vector<int> Fields;
+    };
+
+    // Accumulator and stack of main, top of the stack last. A state that
+    // is not Live is not reached by the previous instruction.
+    struct State {
+        bool Live;
+        int Accu;
+        std::vector<int> Stack;
+        int slot(int n);
+        void push(int Val);
+        void pop(int n);
+    };
+
+    std::vector<ZInstruction*>& Instructions;
+    const std::vector<int32_t>& Positions;
+    const std::vector<int>& Owners;
+
+    std::vector<Value> Values;
+    std::vector<int> Globals;
+    std::vector<bool> Reached;
+    std::vector<int> Worklist;
+
+    // States flowing to instructions not visited yet, by position
+    std::map<int, State> Pending;
+
+    int positionOf(int32_t Idx);
+    int functionAt(int32_t Idx);
+    int makeValue(bool IsBlock, const std::vector<int>& Fns, const std::vector<int>& Fields);
+    int global(int32_t n);
+    int fieldOf(int Val, int32_t n);
+    void escape(int Val);
+    void escapeAll(State& S);
+    void reach(int Fn);
+    void join(State& Into, State& From);
+    void flowTo(int Pos, int32_t DestIdx, State& S);
+    void step(int Pos, State& S);
+    void scanMain(const std::vector<int32_t>& MainPositions);
+    void scanFunction(const std::vector<int32_t>& FuncPositions);
+
+public:
+    // Positions maps instruction indexes to positions in Instructions,
+    // Owners maps positions to the function owning them, main being 0
+    ReachabilityAnalysis(std::vector<ZInstruction*>& Instructions,
+                         const std::vector<int32_t>& Positions,
+                         const std::vector<int>& Owners)
+        : Instructions(Instructions), Positions(Positions), Owners(Owners) {}
+
+    // Whether each function, given the positions of its instructions,
+    // can be called
+    std::vector<bool> run(const std::vector<std::vector<int32_t>>& FuncPositions);
+};
+
+#endif // REACHABILITY_HPP
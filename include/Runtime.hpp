@@ -0,0 +1,18 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+/*
+ * Support code of the generated code, linked in Z3 and in the
+ * executables written by --aot
+ */
+
+// OCaml exceptions unwind the generated code as C++ exceptions
+struct OCamlException {};
+
+extern "C" {
+    void jitRaise();
+    // Runs generated code from C, returns 1 if an OCaml exception escaped it
+    int jitCall(void (*Code)());
+}
+
+#endif // RUNTIME_HPP
@@ -0,0 +1,42 @@
+#ifndef TIMING_HPP
+#define TIMING_HPP
+
+#include <string>
+#include <cstdint>
+
+/*
+ * Wall and CPU time spent in each phase of Z3, and sizes of what the
+ * phases produce. With -t, they are reported on stderr at exit, along with
+ * the time of each LLVM pass.
+ * CPU time is the one of the calling thread, so the phases run by the
+ * workers of ParallelCompiler add up the time of every worker.
+ */
+class Timing {
+public:
+    struct Clock {
+        double Wall;
+        double Cpu;
+        static Clock now();
+    };
+
+    // Adds the time from construction to destruction to a phase
+    class Phase {
+        const char* Name;
+        Clock Start;
+    public:
+        Phase(const char* Name);
+        ~Phase();
+    };
+
+    static bool Enabled;
+    // LLVM pass timers are not thread safe, only time them on one thread
+    static void enable(bool TimePasses);
+
+    static void add(const std::string& Phase, Clock Start);
+    // Time to generate the IR of a function
+    static void addFunction(const std::string& Name, Clock Start);
+    static void count(const std::string& Name, uint64_t N);
+    static void report();
+};
+
+#endif // TIMING_HPP
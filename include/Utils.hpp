@@ -7,6 +7,9 @@ extern "C" {
     #include <unistd.h>
 }
 
+// Part of the key of the code cache, to bump when the generated code changes
+#define Z3_VERSION "0.5"
+
 extern int DBG;
 #define DEBUG(expr) {if (DBG) {expr}}
 
@@ -0,0 +1,100 @@
+#include <AotCompiler.hpp>
+#include <Utils.hpp>
+#include <Timing.hpp>
+#include <cstdlib>
+
+#include "llvm/Constants.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+using namespace std;
+using namespace llvm;
+
+AotCompiler::AotCompiler(GenModule* Mod) {
+    this->Mod = Mod;
+}
+
+void AotCompiler::embed(string Name, const string& Bytes) {
+    auto TheModule = Mod->TheModule;
+    auto Init = ConstantDataArray::getString(getCodeGenContext(), Bytes, false);
+    new GlobalVariable(*TheModule, Init->getType(), true, GlobalValue::ExternalLinkage, Init, Name);
+    new GlobalVariable(*TheModule, getValType(), true, GlobalValue::ExternalLinkage,
+                       ConstantInt::get(getValType(), Bytes.size()), Name + "Size");
+}
+
+void AotCompiler::emitObject(string Path) {
+    auto TheModule = Mod->TheModule;
+    InitializeNativeTargetAsmPrinter();
+
+    string Triple = sys::getDefaultTargetTriple();
+    string ErrStr;
+    auto Target = TargetRegistry::lookupTarget(Triple, ErrStr);
+    if (!Target) {
+        cerr << "Could not find the target " << Triple << ": " << ErrStr << endl;
+        exit(1);
+    }
+
+    // Same options as the JIT, the generated code relies on tail calls
+    TargetOptions TargOps;
+    TargOps.GuaranteedTailCallOpt = 1;
+    auto Machine = Target->createTargetMachine(Triple, sys::getHostCPUName(), "", TargOps,
+                                               Reloc::PIC_, CodeModel::Default,
+                                               CodeGenOpt::Default);
+    TheModule->setTargetTriple(Triple);
+
+    raw_fd_ostream Out(Path.c_str(), ErrStr, raw_fd_ostream::F_Binary);
+    if (!ErrStr.empty()) {
+        cerr << "Could not open " << Path << ": " << ErrStr << endl;
+        exit(1);
+    }
+    formatted_raw_ostream FOut(Out);
+
+    PassManager PM;
+    PM.add(new TargetData(*Machine->getTargetData()));
+    if (Machine->addPassesToEmitFile(PM, FOut, TargetMachine::CGFT_ObjectFile)) {
+        cerr << "Could not emit an object file for " << Triple << endl;
+        exit(1);
+    }
+    PM.run(*TheModule);
+}
+
+bool AotCompiler::link(string ObjPath, string Output, bool Shared) {
+    string Cmd;
+    if (Shared) {
+        Cmd = "clang++ -shared -o " + Output + " " + ObjPath;
+    } else {
+        auto Runtime = getExecutablePath() + "Z3Runtime.a";
+        Cmd = "clang++ -rdynamic -o " + Output + " " + ObjPath + " " + Runtime + " -lcurses -lm -ldl";
+    }
+    DEBUG(cout << Cmd << endl;)
+    if (system(Cmd.c_str())) {
+        cerr << "Could not link " << Output << endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * The module must be fully generated. Main is renamed to the entry
+ * AotMain.cpp calls.
+ */
+bool AotCompiler::emit(string Output, bool Shared) {
+    Mod->MainFunction->LlvmFunc->setName("aotProgram");
+
+    auto ObjPath = Output + ".o";
+    auto Start = Timing::Clock::now();
+    emitObject(ObjPath);
+    Timing::add("native emission", Start);
+
+    Start = Timing::Clock::now();
+    bool Linked = link(ObjPath, Output, Shared);
+    Timing::add("linking", Start);
+    remove(ObjPath.c_str());
+    return Linked;
+}
@@ -0,0 +1,43 @@
+#include <Runtime.hpp>
+
+extern "C" {
+    #include <ocaml_runtime/config.h>
+    #include <ocaml_runtime/startup.h>
+    #include <ocaml_runtime/dynlink.h>
+    #include <ocaml_runtime/custom.h>
+    #include <ocaml_runtime/intext.h>
+    #include <ocaml_runtime/gc_ctrl.h>
+    #include <ocaml_runtime/stacks.h>
+    #include <ocaml_runtime/fail.h>
+    #include <ocaml_runtime/printexc.h>
+
+    void caml_sys_init(char * exe_name, char **argv);
+
+    // Defined in the object written by AotCompiler
+    void aotProgram();
+    extern char aotData[], aotPrim[], aotDlpt[], aotDlls[];
+    extern intnat aotDataSize;
+}
+
+/*
+ * Entry of the executables written by --aot. Sets up the runtime like
+ * Context::init does, from the embedded sections, and runs the program.
+ */
+int main(int argc, char** argv) {
+    caml_init_custom_operations();
+    caml_ext_table_init(&caml_shared_libs_path, 8);
+    caml_external_raise = NULL;
+
+    caml_init_gc(Minor_heap_def, Init_heap_def, Heap_chunk_def,
+                 Percent_free_def, Max_percent_free_def);
+    caml_init_stack(Max_stack_def);
+    init_atoms();
+
+    caml_build_primitive_table(aotDlpt, aotDlls, aotPrim);
+    caml_global_data = caml_input_value_from_block(aotData, aotDataSize);
+    caml_sys_init(argv[0], argv);
+
+    if (jitCall(aotProgram))
+        caml_fatal_uncaught_exception(caml_exn_bucket);
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include <BytecodeOptimizer.hpp>
+#include <Utils.hpp>
+
+using namespace std;
+
+static const int32_t INT32_LIMIT = 0x7FFFFFFF;
+
+static bool fitsArg(int64_t Val) {
+    return Val >= -INT32_LIMIT - 1 && Val <= INT32_LIMIT;
+}
+
+// Representation of an OCaml int, as compared by ULTINT and UGEINT
+static uint64_t tagged(int64_t Val) {
+    return (uint64_t)Val * 2 + 1;
+}
+
+/*
+ * Result of the operation on the accumulator A and the top of the stack
+ * B, false if it can not be computed at compile time or does not fit in
+ * a CONSTINT
+ */
+static bool foldBinary(int OpNum, int64_t A, int64_t B, int64_t& Res) {
+    switch (OpNum) {
+        case ADDINT: Res = A + B; break;
+        case SUBINT: Res = A - B; break;
+        case MULINT: Res = A * B; break;
+        case DIVINT: if (B == 0) return false; Res = A / B; break;
+        case MODINT: if (B == 0) return false; Res = A % B; break;
+        case ANDINT: Res = A & B; break;
+        case ORINT: Res = A | B; break;
+        case XORINT: Res = A ^ B; break;
+        case LSLINT: if (B < 0 || B > 31) return false; Res = (int64_t)((uint64_t)A << B); break;
+        case LSRINT: if (A < 0 || B < 0 || B > 62) return false; Res = A >> B; break;
+        case ASRINT: if (B < 0 || B > 62) return false; Res = A >> B; break;
+        case EQ: Res = A == B; break;
+        case NEQ: Res = A != B; break;
+        case LTINT: Res = A < B; break;
+        case LEINT: Res = A <= B; break;
+        case GTINT: Res = A > B; break;
+        case GEINT: Res = A >= B; break;
+        case ULTINT: Res = tagged(A) < tagged(B); break;
+        case UGEINT: Res = tagged(A) >= tagged(B); break;
+        default: return false;
+    }
+    return fitsArg(Res);
+}
+
+static bool foldUnary(ZInstruction* Inst, int64_t A, int64_t& Res) {
+    switch (Inst->OpNum) {
+        case NEGINT: Res = -A; break;
+        case OFFSETINT: Res = A + Inst->Args[0]; break;
+        case BOOLNOT: Res = 1 - A; break;
+        case ISINT: Res = 1; break;
+        default: return false;
+    }
+    return fitsArg(Res);
+}
+
+/*
+ * Whether the conditional branch is taken when the accumulator is A
+ */
+static bool foldBranch(ZInstruction* Inst, int64_t A, bool& Taken) {
+    int64_t V = Inst->Args[0];
+    switch (Inst->OpNum) {
+        case BRANCHIF: Taken = A != 0; break;
+        case BRANCHIFNOT: Taken = A == 0; break;
+        case BEQ: Taken = V == A; break;
+        case BNEQ: Taken = V != A; break;
+        case BLTINT: Taken = V < A; break;
+        case BLEINT: Taken = V <= A; break;
+        case BGTINT: Taken = V > A; break;
+        case BGEINT: Taken = V >= A; break;
+        case BULTINT: Taken = (uint64_t)V < (uint64_t)A; break;
+        case BUGEINT: Taken = (uint64_t)V >= (uint64_t)A; break;
+        default: return false;
+    }
+    return true;
+}
+
+// Value of the constant loaded by the instruction, or of its push version
+static bool constValue(ZInstruction* Inst, int64_t& Val) {
+    switch (Inst->OpNum) {
+        case CONST0: case CONST1: case CONST2: case CONST3:
+            Val = Inst->OpNum - CONST0; return true;
+        case PUSHCONST0: case PUSHCONST1: case PUSHCONST2: case PUSHCONST3:
+            Val = Inst->OpNum - PUSHCONST0; return true;
+        case CONSTINT: case PUSHCONSTINT:
+            Val = Inst->Args[0]; return true;
+        default:
+            return false;
+    }
+}
+
+// ================ Abstract state ================== //
+
+bool BytecodeOptimizer::AbsVal::same(AbsVal Other) {
+    if (Known) return Other.Known && Int == Other.Int;
+    return Id != 0 && Id == Other.Id;
+}
+
+void BytecodeOptimizer::State::push(AbsVal Val) {
+    for (int i = OPT_TRACKED_SLOTS - 1; i > 0; i--)
+        Slots[i] = Slots[i - 1];
+    Slots[0] = Val;
+}
+
+void BytecodeOptimizer::State::pop(int n) {
+    for (int i = 0; i < OPT_TRACKED_SLOTS; i++)
+        Slots[i] = i + n < OPT_TRACKED_SLOTS ? Slots[i + n] : AbsVal{false, 0, 0};
+}
+
+BytecodeOptimizer::AbsVal BytecodeOptimizer::State::slot(int n) {
+    return n >= 0 && n < OPT_TRACKED_SLOTS ? Slots[n] : AbsVal{false, 0, 0};
+}
+
+void BytecodeOptimizer::State::step(ZInstruction* Inst, int& LastId) {
+    int Effect = Inst->stackEffect();
+    if (Inst->pushesAccu()) {
+        push(Accu);
+        Effect--;
+    }
+    if (Effect < 0) pop(-Effect);
+    for (int i = 0; i < Effect; i++) push(AbsVal{false, 0, 0});
+
+    int64_t Val;
+    switch (Inst->OpNum) {
+        case ACC0: case ACC1: case ACC2: case ACC3:
+        case ACC4: case ACC5: case ACC6: case ACC7:
+            Accu = slot(Inst->OpNum - ACC0); break;
+        case PUSHACC0: case PUSHACC1: case PUSHACC2: case PUSHACC3:
+        case PUSHACC4: case PUSHACC5: case PUSHACC6: case PUSHACC7:
+            Accu = slot(Inst->OpNum - PUSHACC0); break;
+        case ACC: case PUSHACC:
+            Accu = slot(Inst->Args[0]); break;
+        case ASSIGN:
+            if (Inst->Args[0] < OPT_TRACKED_SLOTS) Slots[Inst->Args[0]] = Accu;
+            Accu = AbsVal{true, 0, 0};
+            break;
+        default:
+            if (constValue(Inst, Val)) Accu = AbsVal{true, Val, 0};
+            else if (!Inst->ignoresAccu() && Inst->OpNum != PUSH) Accu = AbsVal{false, 0, ++LastId};
+            break;
+    }
+}
+
+// ================ Rewriting ================== //
+
+ZInstruction* BytecodeOptimizer::make(ZInstruction* From, int OpNum, int32_t Arg) {
+    Storage.push_back(*From);
+    auto Inst = &Storage.back();
+    Inst->OpNum = OpNum;
+    Inst->Args[0] = Arg;
+    Inst->Args[1] = 0;
+    Inst->Payload = nullptr;
+    return Inst;
+}
+
+void BytecodeOptimizer::dropLast() {
+    Cur = States.back();
+    States.pop_back();
+    Out.pop_back();
+}
+
+/*
+ * Stack slot read by an ACC or PUSHACC, before the push, or -1
+ */
+static int loadedSlot(ZInstruction* Inst) {
+    if (Inst->OpNum >= ACC0 && Inst->OpNum <= ACC7) return Inst->OpNum - ACC0;
+    if (Inst->OpNum == ACC) return Inst->Args[0];
+    if (Inst->OpNum >= PUSHACC1 && Inst->OpNum <= PUSHACC7) return Inst->OpNum - PUSHACC1;
+    if (Inst->OpNum == PUSHACC) return Inst->Args[0] - 1;
+    return -1;
+}
+
+/*
+ * Appends the instruction, once simplified with the ones before it
+ */
+void BytecodeOptimizer::emit(ZInstruction* Inst) {
+    while (true) {
+        auto Last = Out.empty() ? nullptr : Out.back();
+        auto Loaded = Cur.slot(loadedSlot(Inst));
+        int64_t Res, Pushed;
+        bool Taken;
+
+        // Pushing the accumulator and reading it back
+        if (Inst->OpNum == PUSHACC0) {
+            Inst = make(Inst, PUSH);
+            continue;
+        }
+        if (Inst->OpNum == ACC0 && Last && Last->OpNum == PUSH)
+            return;
+
+        // Loads of the value already in the accumulator
+        if (loadedSlot(Inst) >= 0 && Loaded.same(Cur.Accu)) {
+            if (!Inst->pushesAccu()) return;
+            Inst = make(Inst, PUSH);
+            continue;
+        }
+
+        // Loads of a slot holding a known int
+        if (Loaded.Known) {
+            Inst = make(Inst, Inst->pushesAccu() ? PUSHCONSTINT : CONSTINT, Loaded.Int);
+            continue;
+        }
+
+        // Pops of what was just pushed
+        if (Inst->OpNum == POP && Last && Last->OpNum == PUSH) {
+            dropLast();
+            if (Inst->Args[0] == 1) return;
+            Inst = make(Inst, POP, Inst->Args[0] - 1);
+            continue;
+        }
+        if (Inst->OpNum == POP && Last && Last->OpNum == POP) {
+            int n = Last->Args[0] + Inst->Args[0];
+            dropLast();
+            Inst = make(Inst, POP, n);
+            continue;
+        }
+
+        // Constant folding
+        if (Cur.Accu.Known && foldUnary(Inst, Cur.Accu.Int, Res)) {
+            Inst = make(Inst, CONSTINT, Res);
+            continue;
+        }
+        if (Cur.Accu.Known && Cur.Slots[0].Known
+            && foldBinary(Inst->OpNum, Cur.Accu.Int, Cur.Slots[0].Int, Res)) {
+            // When the operand on the stack was pushed by the last
+            // instruction, neither the push nor the pop are needed
+            if (Last && Last->pushesAccu() && constValue(Last, Pushed))
+                dropLast();
+            else
+                emit(make(Inst, POP, 1));
+            Inst = make(Inst, CONSTINT, Res);
+            continue;
+        }
+        if (Inst->isCondJump() && Cur.Accu.Known && foldBranch(Inst, Cur.Accu.Int, Taken)) {
+            if (!Taken) return;
+            Inst = make(Inst, BRANCH, Inst->getDestIdx());
+            continue;
+        }
+
+        // The accumulator set by the last instruction is never read
+        if (Inst->overwritesAccu() && Last && Last->overwritesAccu()) {
+            dropLast();
+            continue;
+        }
+        break;
+    }
+
+    Out.push_back(Inst);
+    States.push_back(Cur);
+    Cur.step(Inst, LastId);
+}
+
+bool BytecodeOptimizer::run(vector<ZInstruction*>& Instructions) {
+    Out.clear();
+    States.clear();
+    Cur = State();
+    for (int i = 0; i < OPT_TRACKED_SLOTS; i++)
+        Cur.Slots[i] = AbsVal{false, 0, 0};
+    Cur.Accu = AbsVal{false, 0, 0};
+
+    for (auto Inst : Instructions)
+        emit(Inst);
+
+    // Blocks are never emptied, the first instruction gives their offset
+    if (Out.empty() || Out == Instructions) return false;
+
+    DEBUG(
+        cout << "Bytecode optimizer, block at " << Instructions.front()->idx << ":\n";
+        for (auto Inst : Instructions) { cout << "  "; Inst->Print(); }
+        cout << "became:\n";
+        for (auto Inst : Out) { cout << "  "; Inst->Print(); }
+    )
+    Instructions = Out;
+    return true;
+}
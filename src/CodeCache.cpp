@@ -0,0 +1,72 @@
+#include <CodeCache.hpp>
+#include <AotCompiler.hpp>
+#include <Utils.hpp>
+#include <cstdlib>
+#include <sstream>
+#include <iomanip>
+
+extern "C" {
+    #include <dlfcn.h>
+    #include <sys/stat.h>
+    #include <ocaml_runtime/md5.h>
+}
+
+using namespace std;
+
+static string cacheDir() {
+    auto XdgCache = getenv("XDG_CACHE_HOME");
+    auto Home = getenv("HOME");
+    string Dir = XdgCache ? XdgCache : string(Home ? Home : "/tmp") + "/.cache";
+    mkdir(Dir.c_str(), 0755);
+    Dir += "/z3";
+    mkdir(Dir.c_str(), 0755);
+    return Dir;
+}
+
+CodeCache::CodeCache(const unsigned char* CodeDigest, const string& Prims, const string& Options) {
+    struct MD5Context Ctx;
+    unsigned char Digest[16];
+
+    caml_MD5Init(&Ctx);
+    caml_MD5Update(&Ctx, (unsigned char*)CodeDigest, 16);
+    caml_MD5Update(&Ctx, (unsigned char*)Prims.data(), Prims.size());
+    caml_MD5Update(&Ctx, (unsigned char*)Z3_VERSION, sizeof(Z3_VERSION));
+    caml_MD5Update(&Ctx, (unsigned char*)Options.data(), Options.size());
+    caml_MD5Final(Digest, &Ctx);
+
+    stringstream ss;
+    ss << cacheDir() << "/";
+    for (int i = 0; i < 16; i++)
+        ss << hex << setw(2) << setfill('0') << (int)Digest[i];
+    ss << ".so";
+    Path = ss.str();
+}
+
+void (*CodeCache::load())() {
+    auto Handle = dlopen(Path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!Handle) return nullptr;
+
+    auto Program = dlsym(Handle, "aotProgram");
+    if (!Program) {
+        dlclose(Handle);
+        return nullptr;
+    }
+    DEBUG(cout << "Loaded " << Path << " from the code cache\n";)
+    return (void (*)())Program;
+}
+
+/*
+ * The shared object is written next to its final path and renamed, so that
+ * concurrent runs never load a partial one
+ */
+bool CodeCache::store(GenModule* Mod) {
+    stringstream TmpPath;
+    TmpPath << Path << "." << getpid();
+    if (!AotCompiler(Mod).emit(TmpPath.str(), true))
+        return false;
+    if (rename(TmpPath.str().c_str(), Path.c_str())) {
+        remove(TmpPath.str().c_str());
+        return false;
+    }
+    return true;
+}
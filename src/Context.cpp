@@ -5,6 +5,7 @@
 #include <Utils.hpp>
 #include <iostream>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 extern "C" {
     #include <ocaml_runtime/config.h>
@@ -20,7 +21,9 @@ extern "C" {
     #include <ocaml_runtime/custom.h>
     #include <ocaml_runtime/misc.h>
     #include <ocaml_runtime/fail.h>
+    #include <ocaml_runtime/printexc.h>
     #include <ocaml_runtime/backtrace.h>
+    #include <ocaml_runtime/md5.h>
 
     extern int caml_parser_trace;
 }
@@ -29,9 +32,25 @@ extern "C" {
 #include <Context.hpp>
 #include <Instructions.hpp>
 #include <CodeGen.hpp>
+#include <MixedMode.hpp>
+#include <JitEngine.hpp>
+#include <ParallelCompiler.hpp>
+#include <AotCompiler.hpp>
+#include <CodeCache.hpp>
+#include <Runtime.hpp>
+#include <Timing.hpp>
 
 using namespace std;
 
+// Profile written at exit, see --profile-gen
+static Profile* RecordedProfile = nullptr;
+static string RecordedProfilePath;
+
+static void saveProfile() {
+    if (!RecordedProfile->save(RecordedProfilePath))
+        cerr << "Could not write the profile to " << RecordedProfilePath << endl;
+}
+
 static uintnat percent_free_init = Percent_free_def;
 static uintnat max_percent_free_init = Max_percent_free_def;
 static uintnat minor_heap_init = Minor_heap_def;
@@ -81,11 +100,76 @@ static void parse_camlrunparam4(void)
 }
 
 
+/*
+ * Copy of a section made of null terminated strings, as returned by
+ * read_section, with the terminating empty string
+ */
+static string sectionStrings(char* Section) {
+    if (!Section) return string(1, '\0');
+    auto End = Section;
+    while (*End) End += strlen(End) + 1;
+    return string(Section, End + 1);
+}
+
+// Whether caml_code_md5 holds the digest of the code
+static bool CodeDigested = false;
+
+/*
+ * Maps the CODE section instead of copying it, like caml_load_code does.
+ * The digest of the code is not computed yet, see codeDigest. The code is
+ * copied, and digested, when the runtime has to rewrite it, or when it is
+ * not aligned in the file.
+ */
+static void loadCode(int Fd, asize_t Size) {
+#if !defined(ARCH_BIG_ENDIAN) && !defined(THREADED_CODE)
+    auto Offset = lseek(Fd, 0, SEEK_CUR);
+    auto PageOffset = Offset % sysconf(_SC_PAGESIZE);
+    if (Offset % sizeof(opcode_t) == 0) {
+        auto Map = (char*)mmap(nullptr, Size + PageOffset, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                               Fd, Offset - PageOffset);
+        if (Map != MAP_FAILED) {
+            caml_code_size = Size;
+            caml_start_code = (code_t)(Map + PageOffset);
+            return;
+        }
+    }
+#endif
+    caml_load_code(Fd, Size);
+    CodeDigested = true;
+}
+
+/*
+ * Digest of the code, read by the code cache, and by the marshaler for
+ * closures. Hashing reads every page of the mapped code, so it is only
+ * done when one of them is used.
+ */
+static unsigned char* codeDigest() {
+    if (!CodeDigested) {
+        Timing::Phase T("code digest");
+        struct MD5Context Ctx;
+        caml_MD5Init(&Ctx);
+        caml_MD5Update(&Ctx, (unsigned char*)caml_start_code, caml_code_size);
+        caml_MD5Final(caml_code_md5, &Ctx);
+        CodeDigested = true;
+    }
+    return caml_code_md5;
+}
+
+/*
+ * Whether the program has the primitives of the marshaler, which write
+ * and check the code digest. Prims is as returned by sectionStrings.
+ */
+static bool usesMarshal(const string& Prims) {
+    for (auto Prim = Prims.c_str(); *Prim; Prim += strlen(Prim) + 1)
+        if (!strncmp(Prim, "caml_output_value", 17) || !strncmp(Prim, "caml_input_value", 16))
+            return true;
+    return false;
+}
+
 void Context::init(string _FileName, int EraseFrom, int EraseFirst, int EraseLast) {
 
     char * shared_lib_path, * shared_libs, * req_prims;
     struct exec_trailer Trail;
-    struct channel * chan;
     int Fd;
 
     caml_init_custom_operations();
@@ -102,36 +186,63 @@ void Context::init(string _FileName, int EraseFrom, int EraseFirst, int EraseLas
     caml_read_section_descriptors(Fd, &Trail);
 
     /* Initialize the abstract machine */
+    auto Start = Timing::Clock::now();
     parse_camlrunparam4();
     caml_init_gc (minor_heap_init, heap_size_init, heap_chunk_init,
                 percent_free_init, max_percent_free_init);
     
     caml_init_stack (max_stack_init);
     init_atoms();
+    Timing::add("GC init", Start);
 
     /* Load the code */
+    Start = Timing::Clock::now();
     caml_code_size = caml_seek_section(Fd, &Trail, (char*)"CODE");
-    caml_load_code(Fd, caml_code_size);
+    loadCode(Fd, caml_code_size);
+    Timing::add("code loading", Start);
 
     /* Build the table of primitives */
+    Start = Timing::Clock::now();
     shared_lib_path = read_section(Fd, &Trail, (char*)"DLPT");
     shared_libs = read_section(Fd, &Trail, (char*)"DLLS");
     req_prims = read_section(Fd, &Trail, (char*)"PRIM");
     if (req_prims == NULL) caml_fatal_error((char*)"Fatal error: no PRIM section\n");
     caml_build_primitive_table(shared_lib_path, shared_libs, req_prims);
+    SharedLibPath = sectionStrings(shared_lib_path);
+    SharedLibs = sectionStrings(shared_libs);
+    Prims = sectionStrings(req_prims);
     caml_stat_free(shared_lib_path);
     caml_stat_free(shared_libs);
     caml_stat_free(req_prims);
+    Timing::add("caml_build_primitive_table", Start);
+    if (usesMarshal(Prims)) codeDigest();
 
     /* Load the globals */
-    caml_seek_section(Fd, &Trail, (char*)"DATA");
-    chan = caml_open_descriptor_in(Fd);
-    caml_global_data = caml_input_val(chan);
-    caml_close_channel(chan); /* this also closes Fd */
+    Start = Timing::Clock::now();
+    Data.resize(caml_seek_section(Fd, &Trail, (char*)"DATA"));
+    if (read(Fd, &Data[0], Data.size()) != (ssize_t)Data.size())
+        caml_fatal_error((char*)"Fatal error: truncated DATA section\n");
+    caml_global_data = caml_input_value_from_block(&Data[0], Data.size());
+    close(Fd);
     caml_stat_free(Trail.section);
+    Timing::add("caml_input_val", Start);
+
+    if (UseCache) {
+        string Options = string(1, '0' + OptLevel) + (Locals ? "l" : "");
+        Timing::Phase T("code cache lookup");
+        Cache = new CodeCache(codeDigest(), Prims, Options);
+        CachedProgram = Cache->load();
+        if (CachedProgram) return;
+    }
+
+    Start = Timing::Clock::now();
+    readInstructions(Stream, Instructions, caml_start_code, caml_code_size);
+    Timing::add("readInstructions", Start);
+    Timing::count("instructions", Instructions.size());
 
-    readInstructions(Instructions, caml_start_code, caml_code_size);
+    Start = Timing::Clock::now();
     annotateNodes(Instructions);
+    Timing::add("annotateNodes", Start);
 
     if (EraseFirst != EraseLast) {
         std::vector<ZInstruction*>::iterator Beginning, Ending;
@@ -155,51 +266,124 @@ void Context::init(string _FileName, int EraseFrom, int EraseFirst, int EraseLas
 
 
 void Context::generateMod() {
+    auto Start = Timing::Clock::now();
     GenModuleCreator GMC(&Instructions);
     Mod = GMC.generate(0);
+    Timing::add("GenModuleCreator::generate", Start);
+
+    size_t Blocks = Mod->MainFunction->blockCount();
+    size_t Loops = Mod->MainFunction->loopCount();
+    size_t Rewritten = Mod->MainFunction->rewrittenCount();
+    for (auto FuncP : Mod->Functions) {
+        Blocks += FuncP.second->blockCount();
+        Loops += FuncP.second->loopCount();
+        Rewritten += FuncP.second->rewrittenCount();
+    }
+    Timing::count("functions", Mod->Functions.size() + 1);
+    Timing::count("dead functions", GMC.DeadFunctions);
+    Timing::count("blocks", Blocks);
+    Timing::count("loops", Loops);
+    Timing::count("rewritten instructions", Rewritten);
     DEBUG(Mod->Print();)
 }
 
 
-void Context::compile() {
+/*
+ * Generates the main function. The other ones are generated by the JIT
+ * on their first call, or all of them now when the program is not run.
+ * In mixed mode, main is interpreted. With several threads, the other
+ * functions are all generated in parallel first. A program missing from
+ * the code cache is fully generated, stored, and run from the cache.
+ */
+void Context::compile(bool Lazy) {
     auto MainFunc = Mod->MainFunction;
-    MainFunc->CodeGen();
-
-    if (this->Opt) {
-        Mod->PM->run(*Mod->TheModule);
-        for (auto& F: Mod->TheModule->getFunctionList()) {
-            Mod->FPM->run(F);
+    Mod->Locals = this->Locals;
+    Mod->setOptLevel(OptLevel);
+    Mod->Mixed = this->Mixed;
+    if (ProfileUsePath != "") {
+        Mod->ProfileUse = new Profile();
+        if (!Mod->ProfileUse->load(ProfileUsePath)) {
+            cerr << "Could not read the profile " << ProfileUsePath << endl;
+            exit(1);
         }
-        Mod->FPM->run(*MainFunc->LlvmFunc);
+    }
+    if (ProfileGenPath != "") {
+        Mod->ProfileGen = RecordedProfile = new Profile();
+        RecordedProfilePath = ProfileGenPath;
+        atexit(saveProfile);
+    }
+    if (Threads > 1 && !Mixed)
+        ParallelCompiler(Mod, &Instructions, Threads).run();
+    if (!Mixed)
+        Mod->compileFunction(MainFunc);
+
+    if (!Lazy || Cache)
+        Mod->TheModule->MaterializeAll();
+    if (Cache) {
+        Timing::Phase T("code cache store");
+        if (Cache->store(Mod))
+            CachedProgram = Cache->load();
     }
 
     DEBUG(
         for (auto FuncP : Mod->Functions)
-            FuncP.second->LlvmFunc->dump();
-        MainFunc->LlvmFunc->dump();
+            if (FuncP.second->Generated)
+                FuncP.second->LlvmFunc->dump();
+        if (MainFunc->Generated)
+            MainFunc->LlvmFunc->dump();
     )
 }
 
+/*
+ * Writes the compiled program as a native executable
+ */
+void Context::aot(string Output) {
+    AotCompiler Aot(Mod);
+    Aot.embed("aotData", Data);
+    Aot.embed("aotPrim", Prims);
+    Aot.embed("aotDlpt", SharedLibPath);
+    Aot.embed("aotDlls", SharedLibs);
+    if (!Aot.emit(Output))
+        exit(1);
+}
+
 void Context::exec(bool PrintTime) {
     struct timeval Begin, End;
-    auto MainFunc = Mod->MainFunction;
 
     DEBUG(
-        for (auto FuncP : Mod->Functions) {
+        if (!CachedProgram) for (auto FuncP : Mod->Functions) {
+            if (!FuncP.second->Generated) continue;
             void *Ptr = Mod->ExecEngine->getPointerToFunction(FuncP.second->LlvmFunc);
             cout << "Function " << FuncP.second->name() << " : " << Ptr << endl;
         }
     )
 
 
-    void *FPtr = Mod->ExecEngine->getPointerToFunction(MainFunc->LlvmFunc);
-    void (*FP)() = (void (*)())(intptr_t)FPtr;
-
     if (PrintTime) {
         gettimeofday(&Begin, NULL);
     }
+    auto Start = Timing::Clock::now();
+
+    if (Mixed) {
+        value Res = MixedEngine(Mod, Threshold).run();
+        if (Is_exception_result(Res))
+            caml_fatal_uncaught_exception(Extract_exception(Res));
+    } else {
+        auto FP = CachedProgram;
+        if (!FP) {
+            void *FPtr = Mod->ExecEngine->getPointerToFunction(Mod->MainFunction->LlvmFunc);
+            FP = (void (*)())(intptr_t)FPtr;
+        }
+
+        try {
+            FP();
+        } catch (OCamlException&) {
+            // Only raised with a trap frame, which is always caught
+            caml_fatal_uncaught_exception(caml_exn_bucket);
+        }
+    }
 
-    FP();
+    Timing::add("program run", Start);
 
     if (PrintTime) {
         gettimeofday(&End, NULL);
@@ -209,6 +393,7 @@ void Context::exec(bool PrintTime) {
     }
 
     DEBUG(
+        if (CachedProgram) return;
         void *p = Mod->ExecEngine->getPointerToFunction(Mod->getFunction("printAccu"));
         void (*fp)() = (void (*)())p;
         fp();
@@ -1,8 +1,10 @@
 #include <CodeGen.hpp>
 #include <Utils.hpp>
+#include <Timing.hpp>
 
 #include "llvm/DerivedTypes.h"
 #include "llvm/LLVMContext.h"
+#include "llvm/Metadata.h"
 #include "llvm/Analysis/Verifier.h"
 #include "llvm/Target/TargetData.h"
 #include "llvm/Transforms/Scalar.h"
@@ -22,12 +24,22 @@ using namespace llvm;
 
 // ============================ HELPERS ============================== //
 
+static __thread LLVMContext* CodeGenContext = nullptr;
+
+LLVMContext& getCodeGenContext() {
+    return CodeGenContext ? *CodeGenContext : getGlobalContext();
+}
+
+void setCodeGenContext(LLVMContext* Context) {
+    CodeGenContext = Context;
+}
+
 Type* getValType() {
-    return Type::getIntNTy(getGlobalContext(), sizeof(value) * 8);
+    return Type::getIntNTy(getCodeGenContext(), sizeof(value) * 8);
 }
 
 llvm::Type* getBoolType() {
-    return Type::getInt1Ty(getGlobalContext());
+    return Type::getInt1Ty(getCodeGenContext());
 }
 
 
@@ -38,26 +50,55 @@ GenBlock::GenBlock(int Id, GenFunction* Function) {
     this->Id = Id;
     this->Function = Function;
     this->Builder = Function->Module->Builder;
-    this->Sp = Function->Module->TheModule->getGlobalVariable("StackPointer");
-    this->Accu = Function->Module->TheModule->getGlobalVariable("Accu");
+    this->LlvmBlock = nullptr;
+    this->BrBlock = nullptr;
+    this->NoBrBlock = nullptr;
+    this->Index = Function->Blocks.size();
+    this->PostIndex = -1;
+    this->Idom = nullptr;
+    this->LoopHeader = nullptr;
+    this->LoopDepth = 0;
+    this->CondVal = nullptr;
+    this->ExtraArgs = nullptr;
+    this->IsTrapHandler = false;
+    this->AccuLiveIn = true;
+    this->AccuLiveOut = true;
+
+    // Virtual stack init
+    this->Sp = nullptr;
+    this->Accu = nullptr;
+    this->AccuDirty = false;
+    this->StackOffset = 0;
+    this->EntryShift = 0;
+    this->AtEntry = true;
 
     addBlock();
 }
 
 pair<BasicBlock*, BasicBlock*> GenBlock::addBlock() {
     auto OldBlock = LlvmBlock;
-    LlvmBlock = BasicBlock::Create(getGlobalContext(), name());
+    LlvmBlock = BasicBlock::Create(getCodeGenContext(), name());
     LlvmBlocks.push_back(LlvmBlock);
     return make_pair(OldBlock, LlvmBlock);
 }
 
 void GenBlock::setNext(GenBlock* Block, bool IsBrBlock) {
     NextBlocks.push_back(Block);
-    Block->PreviousBlocks.push_front(this);
+    Block->PreviousBlocks.push_back(this);
     if (IsBrBlock) BrBlock = Block;
     else NoBrBlock = Block;
 }
 
+/*
+ * Dominators have a higher postorder index than the blocks they dominate,
+ * so the dominator tree is walked up from Other until it passes this block
+ */
+bool GenBlock::dominates(GenBlock* Other) {
+    while (Other && Other->PostIndex < PostIndex)
+        Other = Other->Idom;
+    return Other == this;
+}
+
 void GenBlock::addCallInfo() {
     Builder->SetInsertPoint(LlvmBlock);
     makeCall1("addCall", ConstInt(Function->Id));
@@ -69,20 +110,207 @@ std::string GenBlock::name() {
     return ss.str();
 }
 
+// ================ Virtual stack handling ================== //
+
+/*
+ * The ZAM stack is modeled as llvm values. Pushes, pops and accesses
+ * only modify the Stack deque, and the memory stack is written back
+ * by syncStack before every helper call and at block exit.
+ * Helper calls can read and modify the memory stack, so the virtual
+ * stack is emptied after them by invalidateStack.
+ */
+
+bool GenBlock::canJoinPreds() {
+    return !IsTrapHandler
+        && this != Function->FirstBlock
+        && PreviousBlocks.size() > 0;
+}
+
+GlobalVariable* GenBlock::getGlobalVariable(string Name) {
+    return Function->Module->getGlobalVariable(Name);
+}
+
+bool GenBlock::isIntKey(int Key) {
+    if (Key == ACCU_KEY) return EntryState.Accu == ABS_INT;
+    return EntryState.slot(Key) == ABS_INT;
+}
+
+Value* GenBlock::getEntryPhi(int Key) {
+    auto CachedVal = PrevStackCache.find(Key);
+    if (CachedVal != PrevStackCache.end())
+        return CachedVal->second;
+
+    // Phi nodes have to be at the beginning of the entry llvm block
+    auto EntryBlock = LlvmBlocks.front();
+    IRBuilder<> PhiBuilder(EntryBlock, EntryBlock->begin());
+    auto Phi = PhiBuilder.CreatePHI(getValType(), PreviousBlocks.size());
+    PHINodes.push_back(make_pair(Phi, Key));
+
+    // Immediate ints are joined untagged, and tagged again
+    // after the phi nodes in case the tagged value is needed
+    Value* Val = Phi;
+    if (isIntKey(Key)) {
+        BasicBlock::iterator It = EntryBlock->begin();
+        while (It != EntryBlock->end() && isa<PHINode>(It)) It++;
+        IRBuilder<> TagBuilder(EntryBlock, It);
+        Val = TagBuilder.CreateOr(TagBuilder.CreateShl(Phi, 1), ConstInt(1));
+        Function->UntaggedVals[Val] = Phi;
+    }
+
+    PrevStackCache[Key] = Val;
+    return Val;
+}
+
+/*
+ * Returns the value of the stack slot Key (or of the accumulator) when
+ * leaving the block. Must only be called once the block is generated.
+ */
+Value* GenBlock::getExitValue(int Key) {
+    Builder->SetInsertPoint(LlvmBlock->getTerminator());
+    if (Key == ACCU_KEY) return getAccu();
+    return getStackAt(Key);
+}
+
+bool GenBlock::fillPHINodes() {
+    bool Filled = false;
+    while (PHINodes.size()) {
+        auto PhiP = PHINodes.front();
+        PHINodes.pop_front();
+        for (auto PrevBlock : PreviousBlocks) {
+            auto Val = PrevBlock->getExitValue(PhiP.second);
+            if (isIntKey(PhiP.second))
+                Val = PrevBlock->getUntagged(Val);
+            PhiP.first->addIncoming(Val, PrevBlock->LlvmBlock);
+        }
+        Filled = true;
+    }
+    return Filled;
+}
+
+Value* GenBlock::getSp() {
+    if (!Sp) Sp = Builder->CreateLoad(getGlobalVariable("StackPointer"));
+    return Sp;
+}
+
 Value* GenBlock::getStackAt(size_t n) {
-    auto Ptr = Builder->CreateGEP(Sp, ConstInt(n));
-    return Builder->CreateLoad(Ptr);
+    if (n < Stack.size() && Stack[n])
+        return Stack[n]->Val;
+
+    Value* Val;
+    if (AtEntry && canJoinPreds()) {
+        Val = getEntryPhi(StackOffset + EntryShift + (int)n);
+    } else {
+        auto Ptr = Builder->CreateGEP(getSp(), ConstInt(StackOffset + (int)n));
+        Val = Builder->CreateLoad(Ptr);
+    }
+
+    if (Stack.size() <= n) Stack.resize(n + 1, nullptr);
+    Stack[n] = new StackValue(Val);
+    return Val;
+}
+
+Value* GenBlock::getAccu() {
+    if (!Accu) {
+        if (AtEntry && canJoinPreds())
+            Accu = getEntryPhi(ACCU_KEY);
+        else
+            Accu = Builder->CreateLoad(getGlobalVariable("Accu"));
+        AccuDirty = false;
+    }
+
+    // The accumulator holds the i1 result of a comparison,
+    // make an OCaml boolean out of it
+    if (Accu->getType() == getBoolType()) {
+        auto BoolVal = Accu;
+        auto IntVal = Builder->CreateZExt(BoolVal, getValType());
+        Accu = valInt(IntVal);
+        Function->BoolsAsVals[Accu] = BoolVal;
+        Function->UntaggedVals[Accu] = IntVal;
+    }
+
+    return Accu;
 }
 
-Value* GenBlock::getAccu(bool CreatePhi) {
-    return Builder->CreateLoad(Accu);
+/*
+ * Returns the accumulator as an i1, to be used by conditional branches.
+ * Doesn't box the result of a preceding comparison.
+ */
+Value* GenBlock::getCond() {
+    if (Accu && Accu->getType() == getBoolType())
+        return Accu;
+
+    auto Val = getAccu();
+    auto BoolP = Function->BoolsAsVals.find(Val);
+    if (BoolP != Function->BoolsAsVals.end())
+        return BoolP->second;
+
+    return Builder->CreateICmpNE(Val, ConstInt(Val_false), "BranchCmp");
 }
 
-void GenBlock::push(bool CreatePhi) { makeCall0("push"); }
+void GenBlock::setAccu(Value* Val) {
+    Accu = Val;
+    AccuDirty = true;
+}
+
+void GenBlock::syncStack(bool AtExit) {
+    for (size_t i = 0; i < Stack.size(); i++) {
+        if (Stack[i] && Stack[i]->Dirty) {
+            auto Ptr = Builder->CreateGEP(getSp(), ConstInt(StackOffset + (int)i));
+            Builder->CreateStore(Stack[i]->Val, Ptr);
+            Stack[i]->Dirty = false;
+        }
+    }
 
-void GenBlock::acc(int n) {makeCall1("acc", ConstInt(n));}
+    if (StackOffset != 0) {
+        Sp = Builder->CreateGEP(getSp(), ConstInt(StackOffset));
+        Builder->CreateStore(Sp, getGlobalVariable("StackPointer"));
+        EntryShift += StackOffset;
+        StackOffset = 0;
+    }
+
+    // The accumulator doesn't need to be written back if
+    // no successor reads it
+    if (AccuDirty && !(AtExit && !AccuLiveOut)) {
+        Builder->CreateStore(getAccu(), getGlobalVariable("Accu"));
+        AccuDirty = false;
+    }
+}
+
+void GenBlock::invalidateStack() {
+    Stack.clear();
+    Sp = nullptr;
+    Accu = nullptr;
+    AccuDirty = false;
+    StackOffset = 0;
+    AtEntry = false;
+}
+
+void GenBlock::push() { pushValue(getAccu()); }
+
+void GenBlock::pushValue(Value* Val) {
+    Stack.push_front(new StackValue(Val, true));
+    StackOffset--;
+}
+
+void GenBlock::pop(int n) {
+    for (int i = 0; i < n && Stack.size(); i++)
+        Stack.pop_front();
+    StackOffset += n;
+}
+
+void GenBlock::assign(int n) {
+    if (Stack.size() <= (size_t)n) Stack.resize(n + 1, nullptr);
+    Stack[n] = new StackValue(getAccu(), true);
+    setAccu(ConstInt(Val_unit));
+}
 
-void GenBlock::envAcc(int n) { makeCall1("envAcc", ConstInt(n)); }
+void GenBlock::acc(int n) { setAccu(getStackAt(n)); }
+
+void GenBlock::envAcc(int n) {
+    auto Env = Builder->CreateLoad(getGlobalVariable("Env"));
+    auto Ptr = Builder->CreateGEP(castToPtr(Env), ConstInt(n));
+    setAccu(Builder->CreateLoad(Ptr));
+}
 
 void GenBlock::pushAcc(int n) { push(); acc(n); }
 
@@ -95,8 +323,34 @@ BasicBlock* GenBlock::CodeGen() {
     if (Function->Id == MAIN_FUNCTION_ID && this->PreviousBlocks.size() == 0)
         makeCall0("init");
 
-    for (auto Inst : this->Instructions)
+    if (IsTrapHandler)
+        Builder->CreateCall(getFunction("getExceptionValue"));
+
+    // The native entry gets the closure and the arguments as parameters,
+    // the arguments are pushed on the virtual stack, first one on top
+    if (Function->Native && this == Function->FirstBlock) {
+        auto& Params = Function->NativeParams;
+        Params.clear();
+        for (auto ArgIt = Function->NativeFunc->arg_begin(); ArgIt != Function->NativeFunc->arg_end(); ArgIt++) {
+            auto Phi = Builder->CreatePHI(getValType(), 2);
+            Phi->addIncoming(ArgIt, Function->EntryBlock);
+            Params.push_back(Phi);
+        }
+        Builder->CreateStore(Params[0], getGlobalVariable("Env"));
+        for (size_t i = 1; i < Params.size(); i++) {
+            Stack.push_back(new StackValue(Params[i], true));
+            StackOffset--;
+        }
+    }
+
+    if (!Instructions.empty())
+        countExecution(Profile::BLOCK, Instructions.front()->OrigIdx);
+
+    CurState = EntryState;
+    for (auto Inst : this->Instructions) {
         GenCodeForInst(Inst);
+        CurState.step(Inst, Function);
+    }
 
     return LlvmBlock;
 }
@@ -106,8 +360,10 @@ void GenBlock::genTermInst() {
     Builder->SetInsertPoint(LlvmBlock);
     auto Inst = Instructions.back();
 
-    if (!(Inst->isJumpInst() || Inst->isReturn() || Inst->isSwitch()))
-        Builder->CreateBr(this->NextBlocks.front()->LlvmBlock);
+    if (!(Inst->isJumpInst() || Inst->isReturn() || Inst->isSwitch())) {
+        syncStack(true);
+        Builder->CreateBr(NoBrBlock->LlvmBlocks.front());
+    }
 }
 
 Value* GenBlock::castToInt(Value* Val) {
@@ -117,56 +373,56 @@ Value* GenBlock::castToInt(Value* Val) {
         return Val;
 }
 
-Value* GenBlock::castToVal(Value* Val) {
-    if (Val->getType() != getValType()) {
-        if (Function->BoolsAsVals.find(Val) != Function->BoolsAsVals.end()) {
-            return Function->BoolsAsVals[Val];
-        } else {
-            return Builder->CreateIntCast(Val, getValType(), true);
-        }
-    } else
-        return Val;
-}
-
-Value* GenBlock::castToBool(llvm::Value* Val) {
-    return Builder->CreateIntCast( Val,
-        Type::getInt1Ty(getGlobalContext()),
-        true
-    );
-}
-
 Value* GenBlock::castToPtr(Value* Val) {
-    if (Val->getType() != getValType())
+    if (Val->getType() == getValType())
         return Builder->CreateIntToPtr(Val, getValType()->getPointerTo());
     else
         return Val;
 }
 
 Value* GenBlock::intVal(Value* From) {
-    return Builder->CreateLShr(From, 1);
+    return Builder->CreateAShr(From, 1);
 }
 
 Value* GenBlock::valInt(Value* From) {
     return Builder->CreateAdd(Builder->CreateShl(From, 1), ConstInt(1));
 }
 
-ConstantInt* ConstInt(uint64_t val) {
-    return ConstantInt::get(
-        getGlobalContext(), 
-        APInt(sizeof(value)*8, val, /*signed=*/true)
-    );
+bool GenBlock::hasUntagged(Value* Val) {
+    return isa<ConstantInt>(Val)
+        || Function->UntaggedVals.find(Val) != Function->UntaggedVals.end();
 }
 
-void GenBlock::makeCheckedCall(Value* Callee, ArrayRef<Value*> Args) {
-    Accu = Builder->CreateCall(Callee, Args);
+Value* GenBlock::getUntagged(Value* Val) {
+    auto UntaggedP = Function->UntaggedVals.find(Val);
+    if (UntaggedP != Function->UntaggedVals.end())
+        return UntaggedP->second;
+    return intVal(Val);
 }
 
-Value* GenBlock::createArrayFromStack(size_t Size) {
-    return Builder->CreateGEP(Sp, ConstInt(1));
+/*
+ * Sets the accumulator to an int computed untagged. The tagged value
+ * is only used if the int escapes to memory or to a helper.
+ * OCaml ints have 63 bits, so the result is wrapped like tagging
+ * would, for the comparisons and divisions reading it untagged.
+ */
+void GenBlock::setIntAccu(Value* Result) {
+    auto Untagged = Builder->CreateAShr(Builder->CreateShl(Result, 1), 1);
+    auto Tagged = valInt(Untagged);
+    Function->UntaggedVals[Tagged] = Untagged;
+    setAccu(Tagged);
+}
+
+ConstantInt* ConstInt(uint64_t val) {
+    return ConstantInt::get(
+        getCodeGenContext(), 
+        APInt(sizeof(value)*8, val, /*signed=*/true)
+    );
 }
 
 void GenBlock::makeOffsetClosure(int32_t n) {
-    Accu = Builder->CreateCall(getFunction("shiftClosure"), ConstInt(n));
+    auto Env = Builder->CreateLoad(getGlobalVariable("Env"));
+    setAccu(Builder->CreateAdd(Env, ConstInt(n * (int)sizeof(value))));
 }
 
 void GenBlock::makeSetField(size_t n) {
@@ -174,36 +430,301 @@ void GenBlock::makeSetField(size_t n) {
 }
 
 void GenBlock::makeGetField(size_t n) {
-    makeCall1("getField", ConstInt(n));
+    auto Ptr = Builder->CreateGEP(castToPtr(getAccu()), ConstInt(n));
+    setAccu(Builder->CreateLoad(Ptr));
+}
+
+/*
+ * Reads the global n from caml_global_data, without the getGlobal helper
+ * and the stack sync it needs. The global data block is reloaded each
+ * time, as a compaction can move it.
+ */
+void GenBlock::makeGetGlobal(int32_t n) {
+    auto GlobalData = Builder->CreateLoad(getGlobalVariable("caml_global_data"));
+    auto Ptr = Builder->CreateGEP(castToPtr(GlobalData), ConstInt(n));
+    setAccu(Builder->CreateLoad(Ptr));
+}
+
+// ================ Minor heap allocation ================== //
+
+/*
+ * Allocates a block of WoSize words in the minor heap, as Alloc_small does.
+ * The young pointer bump and the limit check are inline, the minor
+ * collection is only called when the minor heap is full. Values held
+ * in registers are registered as GC roots around it, and joined with
+ * their fast path version after it. The fields of the block must be read
+ * after the allocation.
+ */
+Value* GenBlock::makeAlloc(size_t WoSize, int Tag) {
+    auto YoungPtrVar = getGlobalVariable("caml_young_ptr");
+    auto YoungLimitVar = getGlobalVariable("caml_young_limit");
+    auto Size = ConstInt(-(int64_t)Bhsize_wosize(WoSize));
+
+    // Values used on both paths must be computed before the branch
+    getAccu();
+    if (Stack.size()) getSp();
+
+    auto NewPtr = Builder->CreateGEP(Builder->CreateLoad(YoungPtrVar), Size);
+    auto NeedGC = Builder->CreateICmpULT(NewPtr, Builder->CreateLoad(YoungLimitVar));
+    auto FastBlock = Builder->GetInsertBlock();
+    auto Blocks = addBlock();
+    auto SlowBlock = Blocks.second;
+    Blocks = addBlock();
+    auto JoinBlock = Blocks.second;
+    Builder->CreateCondBr(NeedGC, SlowBlock, JoinBlock);
+
+    // Slow path: collect, and read the values the GC may have moved
+    Builder->SetInsertPoint(SlowBlock);
+    auto Roots = saveRoots(true);
+    Builder->CreateCall(getFunction("minorCollection"));
+    restoreRoots(Roots);
+    auto SlowNewPtr = Builder->CreateGEP(Builder->CreateLoad(YoungPtrVar), Size);
+
+    // Values in memory are updated by the GC itself
+    for (size_t i = 0; i < Stack.size(); i++) {
+        if (!Stack[i] || Stack[i]->Dirty || !isPointerVal(Stack[i]->Val))
+            continue;
+        auto Ptr = Builder->CreateGEP(getSp(), ConstInt(StackOffset + (int)i));
+        Roots.Keys.push_back(i);
+        Roots.Vals.push_back(Builder->CreateLoad(Ptr));
+    }
+    Builder->CreateBr(JoinBlock);
+
+    // Join both paths
+    Builder->SetInsertPoint(JoinBlock);
+    auto PtrPhi = Builder->CreatePHI(NewPtr->getType(), 2);
+    PtrPhi->addIncoming(NewPtr, FastBlock);
+    PtrPhi->addIncoming(SlowNewPtr, SlowBlock);
+    for (size_t i = 0; i < Roots.Keys.size(); i++) {
+        auto Phi = Builder->CreatePHI(getValType(), 2);
+        Phi->addIncoming(getRootedVal(Roots.Keys[i]), FastBlock);
+        Phi->addIncoming(Roots.Vals[i], SlowBlock);
+        setRootedVal(Roots.Keys[i], Phi);
+    }
+
+    // Values not loaded yet must now be read from memory
+    AtEntry = false;
+
+    Builder->CreateStore(PtrPhi, YoungPtrVar);
+    auto Header = Builder->CreateBitCast(PtrPhi, getValType()->getPointerTo());
+    Builder->CreateStore(ConstInt(Make_header(WoSize, Tag, Caml_black)), Header);
+
+    return Builder->CreatePtrToInt(Builder->CreateGEP(Header, ConstInt(1)), getValType());
+}
+
+// ================ GC roots ================== //
+
+/*
+ * Values of the virtual stack and the accumulator can be kept in registers
+ * across calls that may trigger the GC. The ones that can be heap pointers
+ * are registered as local roots of the OCaml runtime (caml_local_roots)
+ * during the call: they are stored in a table of the function frame,
+ * which the GC scans and updates, and read back from it after the call.
+ */
+
+bool GenBlock::isPointerVal(Value* Val) {
+    return !isa<Constant>(Val) && !hasUntagged(Val);
+}
+
+Value* GenBlock::getRootedVal(int Key) {
+    if (Key == ACCU_KEY) return Accu;
+    return Stack[Key]->Val;
+}
+
+void GenBlock::setRootedVal(int Key, Value* Val) {
+    if (Key == ACCU_KEY) Accu = Val;
+    else Stack[Key]->Val = Val;
+}
+
+/*
+ * Registers the dirty values of the virtual stack, the accumulator
+ * if WithAccu, and the Extra values as GC roots
+ */
+GCRoots GenBlock::saveRoots(bool WithAccu, ArrayRef<Value*> Extra) {
+    GCRoots Roots;
+    for (size_t i = 0; i < Stack.size(); i++)
+        if (Stack[i] && Stack[i]->Dirty && isPointerVal(Stack[i]->Val))
+            Roots.Keys.push_back(i);
+    if (WithAccu && isPointerVal(getAccu()))
+        Roots.Keys.push_back(ACCU_KEY);
+
+    for (auto Key : Roots.Keys)
+        Roots.Vals.push_back(getRootedVal(Key));
+    Roots.Vals.insert(Roots.Vals.end(), Extra.begin(), Extra.end());
+    Roots.Prev = nullptr;
+    if (Roots.Vals.empty()) return Roots;
+
+    auto Slots = Function->getRootSlots(Roots.Vals.size());
+    for (size_t i = 0; i < Roots.Vals.size(); i++)
+        Builder->CreateStore(Roots.Vals[i], Builder->CreateGEP(Slots, ConstInt(i)));
+
+    // struct caml__roots_block { next, ntables, nitems, tables[] }
+    auto LocalRoots = Builder->CreateBitCast(getGlobalVariable("caml_local_roots"),
+                                             getValType()->getPointerTo());
+    auto RootsBlock = Function->getRootsBlock();
+    Roots.Prev = Builder->CreateLoad(LocalRoots);
+    Builder->CreateStore(Roots.Prev, Builder->CreateGEP(RootsBlock, ConstInt(0)));
+    Builder->CreateStore(ConstInt(1), Builder->CreateGEP(RootsBlock, ConstInt(1)));
+    Builder->CreateStore(ConstInt(Roots.Vals.size()), Builder->CreateGEP(RootsBlock, ConstInt(2)));
+    Builder->CreateStore(Builder->CreatePtrToInt(Slots, getValType()),
+                         Builder->CreateGEP(RootsBlock, ConstInt(3)));
+    Builder->CreateStore(Builder->CreatePtrToInt(RootsBlock, getValType()), LocalRoots);
+
+    return Roots;
+}
+
+/*
+ * Unregisters the roots, and reads their possibly moved values
+ */
+void GenBlock::restoreRoots(GCRoots& Roots) {
+    if (!Roots.Prev) return;
+
+    auto LocalRoots = Builder->CreateBitCast(getGlobalVariable("caml_local_roots"),
+                                             getValType()->getPointerTo());
+    Builder->CreateStore(Roots.Prev, LocalRoots);
+
+    auto Slots = Function->getRootSlots(Roots.Vals.size());
+    for (size_t i = 0; i < Roots.Vals.size(); i++)
+        Roots.Vals[i] = Builder->CreateLoad(Builder->CreateGEP(Slots, ConstInt(i)));
+}
+
+void GenBlock::storeField(Value* Block, size_t n, Value* Val) {
+    Builder->CreateStore(Val, Builder->CreateGEP(castToPtr(Block), ConstInt(n)));
+}
+
+/*
+ * MAKEBLOCK: the first field is the accumulator, the others are popped
+ */
+void GenBlock::makeBlockAlloc(size_t WoSize, int Tag) {
+    auto Block = makeAlloc(WoSize, Tag);
+    storeField(Block, 0, getAccu());
+    for (size_t i = 1; i < WoSize; i++)
+        storeField(Block, i, getStackAt(i - 1));
+    pop(WoSize - 1);
+    setAccu(Block);
+}
+
+void GenBlock::makeGetFloatField(size_t n) {
+    auto Block = makeAlloc(Double_wosize, Double_tag);
+    makeGetField(n);
+    storeField(Block, 0, getAccu());
+    setAccu(Block);
+}
+
+/*
+ * CLOSURE: the code pointer, then the accumulator and NVars - 1
+ * popped values as environment
+ */
+void GenBlock::makeClosure(int NVars, int FnId) {
+    auto CodePtr = getPtrToFunc(FnId);
+    auto Block = makeAlloc(1 + NVars, Closure_tag);
+    storeField(Block, 0, CodePtr);
+    if (NVars > 0) {
+        storeField(Block, 1, getAccu());
+        for (int i = 1; i < NVars; i++)
+            storeField(Block, i + 1, getStackAt(i - 1));
+        pop(NVars - 1);
+    }
+    setAccu(Block);
+}
+
+/*
+ * CLOSUREREC: one block holding the code pointers of the NFuncs functions,
+ * separated by infix headers, and the environment. The closure of every
+ * function is pushed, the last one on top.
+ */
+void GenBlock::makeClosureRec(ZInstruction* Inst) {
+    int NFuncs = Inst->Args[0];
+    int NVars = Inst->Args[1];
+
+    vector<Value*> CodePtrs;
+    for (int i = 0; i < NFuncs; i++)
+        CodePtrs.push_back(getPtrToFunc(Inst->closureRecFns()[i]));
+
+    auto Block = makeAlloc(NFuncs * 2 - 1 + NVars, Closure_tag);
+    if (NVars > 0) {
+        storeField(Block, NFuncs * 2 - 1, getAccu());
+        for (int i = 1; i < NVars; i++)
+            storeField(Block, NFuncs * 2 - 1 + i, getStackAt(i - 1));
+        pop(NVars - 1);
+    }
+
+    storeField(Block, 0, CodePtrs[0]);
+    pushValue(Block);
+    for (int i = 1; i < NFuncs; i++) {
+        storeField(Block, i * 2 - 1, ConstInt(Make_header(i * 2, Infix_tag, Caml_white)));
+        storeField(Block, i * 2, CodePtrs[i]);
+        pushValue(Builder->CreateAdd(Block, ConstInt(i * 2 * sizeof(value))));
+    }
+    setAccu(Block);
+}
+
+/*
+ * Calls to StdLib helpers. Helpers work on the VM registers in memory,
+ * so the virtual stack is written back before the call, and forgotten
+ * after it.
+ */
+Value* GenBlock::makeCall(std::string FuncName, ArrayRef<Value*> Args) {
+    syncStack();
+    auto Call = createCall(getFunction(FuncName), Args);
+    invalidateStack();
+    return Call;
+}
+
+bool GenBlock::inTryBlock() {
+    return !CurState.Traps.empty();
+}
+
+/*
+ * Calls that may raise are invokes in a try block, unwinding to the
+ * innermost handler. The code after an invoke goes in a new block.
+ */
+Instruction* GenBlock::createCall(Value* Callee, ArrayRef<Value*> Args, bool FastCC) {
+    if (!inTryBlock()) {
+        auto Call = Builder->CreateCall(Callee, Args);
+        if (FastCC) Call->setCallingConv(CallingConv::Fast);
+        return Call;
+    }
+
+    auto CurBlock = Builder->GetInsertBlock();
+    auto NormalBlock = BasicBlock::Create(getCodeGenContext(), name());
+    LlvmBlocks.push_back(NormalBlock);
+    if (CurBlock == LlvmBlock) LlvmBlock = NormalBlock;
+
+    auto Invoke = Builder->CreateInvoke(Callee, NormalBlock,
+                                        Function->getLandingPad(CurState.Traps.back()), Args);
+    if (FastCC) Invoke->setCallingConv(CallingConv::Fast);
+    Builder->SetInsertPoint(NormalBlock);
+    return Invoke;
 }
 
 Value* GenBlock::makeCall0(std::string FuncName) {
-    return Builder->CreateCall(getFunction(FuncName));
+    return makeCall(FuncName, ArrayRef<Value*>());
 }
 
 Value* GenBlock::makeCall1(std::string FuncName, llvm::Value* arg1) {
-    return Builder->CreateCall(getFunction(FuncName), arg1);
+    Value* Args[] = {arg1};
+    return makeCall(FuncName, Args);
 }
 
 Value* GenBlock::makeCall2(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2) {
-    return Builder->CreateCall2(getFunction(FuncName), arg1, arg2);
+    Value* Args[] = {arg1, arg2};
+    return makeCall(FuncName, Args);
 }
 
 Value* GenBlock::makeCall3(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2, llvm::Value* arg3) {
-    return Builder->CreateCall3(getFunction(FuncName), arg1, arg2, arg3);
+    Value* Args[] = {arg1, arg2, arg3};
+    return makeCall(FuncName, Args);
 }
 
 Value* GenBlock::makeCall4(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2, llvm::Value* arg3, llvm::Value* arg4) {
-    return Builder->CreateCall4(getFunction(FuncName), arg1, arg2, arg3, arg4);
+    Value* Args[] = {arg1, arg2, arg3, arg4};
+    return makeCall(FuncName, Args);
 }
 
 Value* GenBlock::makeCall5(std::string FuncName, llvm::Value* arg1, llvm::Value* arg2, llvm::Value* arg3, llvm::Value* arg4, llvm::Value* arg5) {
-    return Builder->CreateCall5(getFunction(FuncName), arg1, arg2, arg3, arg4, arg5);
-}
-
-void GenBlock::makeBoolToIntCast() {
-    auto AsVal = valInt(Builder->CreateIntCast(Accu, getValType(), true));
-    Function->BoolsAsVals[Accu] = AsVal;
+    Value* Args[] = {arg1, arg2, arg3, arg4, arg5};
+    return makeCall(FuncName, Args);
 }
 
 void GenBlock::debug(Value* DbgVal) {
@@ -213,6 +734,228 @@ void GenBlock::debug(Value* DbgVal) {
     Builder->CreateCall(getFunction("debug"), DbgVal);
 }
 
+// ================ Profile ================== //
+
+/*
+ * Increments the counter of the profile being recorded. The program runs
+ * on one thread, and the counter lives as long as Z3, so its address is
+ * a constant.
+ */
+void GenBlock::countExecution(Profile::Kind K, int32_t Offset) {
+    auto ProfileGen = Function->Module->ProfileGen;
+    if (!ProfileGen) return;
+
+    auto I64Ty = Type::getInt64Ty(getCodeGenContext());
+    auto Address = ConstantInt::get(I64Ty, (uint64_t)(intptr_t)ProfileGen->counter(K, Offset));
+    auto Counter = ConstantExpr::getIntToPtr(Address, PointerType::getUnqual(I64Ty));
+    Builder->CreateStore(Builder->CreateAdd(Builder->CreateLoad(Counter), ConstantInt::get(I64Ty, 1)), Counter);
+}
+
+/*
+ * Blocks that never ran in the profiled run
+ */
+bool GenBlock::isCold() {
+    auto ProfileUse = Function->Module->ProfileUse;
+    return ProfileUse && !Instructions.empty()
+        && ProfileUse->count(Profile::BLOCK, Instructions.front()->OrigIdx) == 0;
+}
+
+bool GenBlock::isColdSite(ZInstruction* Inst) {
+    auto ProfileUse = Function->Module->ProfileUse;
+    return ProfileUse && Inst->isApply()
+        && ProfileUse->count(Profile::APPLY, Inst->OrigIdx) == 0;
+}
+
+/*
+ * Tags the calls generated since the FirstInst instruction of the
+ * FirstBlock llvm block, so that their helpers are not inlined
+ */
+void GenBlock::markColdCalls(size_t FirstBlock, size_t FirstInst) {
+    auto Cold = MDNode::get(getCodeGenContext(), ArrayRef<Value*>());
+    auto BBIt = LlvmBlocks.begin();
+    advance(BBIt, FirstBlock);
+    for (bool First = true; BBIt != LlvmBlocks.end(); BBIt++, First = false) {
+        auto It = (*BBIt)->begin();
+        if (First) advance(It, FirstInst);
+        for (; It != (*BBIt)->end(); It++) {
+            if (!isa<CallInst>(It)) continue;
+            It->setMetadata("z3.cold", Cold);
+            Timing::count("cold calls", 1);
+        }
+    }
+}
+
+/*
+ * Weights of a conditional branch, from the counts of its successors.
+ * A successor can also be entered from other blocks, so it is only exact
+ * when the branch is their only predecessor.
+ */
+void GenBlock::setBranchWeights(Instruction* Br, GenBlock* TrueBlock, GenBlock* FalseBlock) {
+    auto ProfileUse = Function->Module->ProfileUse;
+    if (!ProfileUse || TrueBlock->Instructions.empty() || FalseBlock->Instructions.empty())
+        return;
+
+    uint64_t TrueCount = ProfileUse->count(Profile::BLOCK, TrueBlock->Instructions.front()->OrigIdx);
+    uint64_t FalseCount = ProfileUse->count(Profile::BLOCK, FalseBlock->Instructions.front()->OrigIdx);
+    while (TrueCount >= UINT32_MAX || FalseCount >= UINT32_MAX) {
+        TrueCount >>= 1;
+        FalseCount >>= 1;
+    }
+
+    auto& Context = getCodeGenContext();
+    auto I32Ty = Type::getInt32Ty(Context);
+    Value* Weights[] = {
+        MDString::get(Context, "branch_weights"),
+        ConstantInt::get(I32Ty, TrueCount + 1),
+        ConstantInt::get(I32Ty, FalseCount + 1)
+    };
+    Br->setMetadata(LLVMContext::MD_prof, MDNode::get(Context, Weights));
+    Timing::count("weighted branches", 1);
+}
+
+// ================ Inline integer arithmetic ================== //
+
+/*
+ * Integer operations work directly on tagged values (2n + 1), as the
+ * interpreter does, so that no untagging is needed for most of them.
+ */
+void GenBlock::makeIntOp(ZInstruction* Inst) {
+    Value* Res;
+
+    if (Inst->OpNum == BOOLNOT) {
+        if (Accu && Accu->getType() == getBoolType())
+            setAccu(Builder->CreateNot(Accu));
+        else
+            setAccu(Builder->CreateXor(getAccu(), ConstInt(Val_true ^ Val_false)));
+        return;
+    }
+
+    auto A = getAccu();
+
+    // Values already known untagged stay untagged
+    switch (Inst->OpNum) {
+        case NEGINT:
+            if (hasUntagged(A))
+                setIntAccu(Builder->CreateNeg(getUntagged(A)));
+            else
+                setAccu(Builder->CreateSub(ConstInt(2), A));
+            return;
+        case OFFSETINT:
+            if (hasUntagged(A))
+                setIntAccu(Builder->CreateAdd(getUntagged(A), ConstInt((int64_t)Inst->Args[0])));
+            else
+                setAccu(Builder->CreateAdd(A, ConstInt((int64_t)Inst->Args[0] << 1)));
+            return;
+        case ISINT: setAccu(valInt(Builder->CreateAnd(A, ConstInt(1)))); return;
+        default: break;
+    }
+
+    auto B = getStackAt(0);
+    pop(1);
+    bool Untagged = hasUntagged(A) && hasUntagged(B);
+
+    switch (Inst->OpNum) {
+        case ADDINT:
+            if (Untagged) {
+                setIntAccu(Builder->CreateAdd(getUntagged(A), getUntagged(B)));
+                return;
+            }
+            Res = Builder->CreateSub(Builder->CreateAdd(A, B), ConstInt(1));
+            break;
+        case SUBINT:
+            if (Untagged) {
+                setIntAccu(Builder->CreateSub(getUntagged(A), getUntagged(B)));
+                return;
+            }
+            Res = Builder->CreateAdd(Builder->CreateSub(A, B), ConstInt(1));
+            break;
+        case MULINT:
+            setIntAccu(Builder->CreateMul(getUntagged(A), getUntagged(B)));
+            return;
+        case ANDINT: Res = Builder->CreateAnd(A, B); break;
+        case ORINT: Res = Builder->CreateOr(A, B); break;
+        case XORINT: Res = Builder->CreateOr(Builder->CreateXor(A, B), ConstInt(1)); break;
+        case LSLINT:
+            Res = Builder->CreateAdd(Builder->CreateShl(Builder->CreateSub(A, ConstInt(1)), intVal(B)),
+                                     ConstInt(1));
+            break;
+        case LSRINT:
+            Res = Builder->CreateOr(Builder->CreateLShr(Builder->CreateSub(A, ConstInt(1)), intVal(B)),
+                                    ConstInt(1));
+            break;
+        case ASRINT:
+            Res = Builder->CreateOr(Builder->CreateAShr(Builder->CreateSub(A, ConstInt(1)), intVal(B)),
+                                    ConstInt(1));
+            break;
+        default:
+            throw std::logic_error("Not an integer operation");
+    }
+
+    setAccu(Res);
+}
+
+/*
+ * Comparisons leave an i1 in the accumulator. It is only turned into
+ * an OCaml boolean if something else than a conditional branch uses it
+ */
+void GenBlock::makeIntCmp(ZInstruction* Inst) {
+    Value* Res;
+    auto A = getAccu();
+    auto B = getStackAt(0);
+    pop(1);
+
+    // Tagging preserves ordering, compare untagged values if
+    // that's what is available
+    if (hasUntagged(A) && hasUntagged(B)) {
+        A = getUntagged(A);
+        B = getUntagged(B);
+    }
+
+    switch (Inst->OpNum) {
+        case EQ: Res = Builder->CreateICmpEQ(A, B); break;
+        case NEQ: Res = Builder->CreateICmpNE(A, B); break;
+        case LTINT: Res = Builder->CreateICmpSLT(A, B); break;
+        case LEINT: Res = Builder->CreateICmpSLE(A, B); break;
+        case GTINT: Res = Builder->CreateICmpSGT(A, B); break;
+        case GEINT: Res = Builder->CreateICmpSGE(A, B); break;
+        case ULTINT: Res = Builder->CreateICmpULT(A, B); break;
+        case UGEINT: Res = Builder->CreateICmpUGE(A, B); break;
+        default:
+            throw std::logic_error("Not a comparison");
+    }
+
+    setAccu(Res);
+}
+
+void GenBlock::makeDivOp(ZInstruction* Inst) {
+    auto A = getUntagged(getAccu());
+    auto B = getUntagged(getStackAt(0));
+    pop(1);
+
+    // The handler reads the stack from memory
+    if (inTryBlock()) syncStack();
+
+    // Division by zero raises an OCaml exception
+    auto IsZero = Builder->CreateICmpEQ(B, ConstInt(0));
+    auto Blocks = addBlock();
+    auto BlockRaise = Blocks.second;
+    Blocks = addBlock();
+    auto BlockContinue = Blocks.second;
+    Builder->CreateCondBr(IsZero, BlockRaise, BlockContinue);
+
+    Builder->SetInsertPoint(BlockRaise);
+    auto RaiseFT = FunctionType::get(Type::getVoidTy(getCodeGenContext()), false);
+    createCall(Function->Module->TheModule->getOrInsertFunction("caml_raise_zero_divide", RaiseFT),
+               ArrayRef<Value*>());
+    Builder->CreateUnreachable();
+
+    Builder->SetInsertPoint(BlockContinue);
+    if (Inst->OpNum == DIVINT)
+        setIntAccu(Builder->CreateSDiv(A, B));
+    else
+        setIntAccu(Builder->CreateSRem(A, B));
+}
+
 void GenBlock::GenCodeForInst(ZInstruction* Inst) {
 
     Value *TmpVal;
@@ -226,58 +969,48 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
 
     //debug(ConstInt(Inst->OrigIdx));
 
+    // Helpers of the APPLY sites that never ran are not inlined
+    bool ColdSite = isColdSite(Inst);
+    size_t SiteBlock = LlvmBlocks.size() - 1;
+    size_t SiteInst = LlvmBlocks.back()->size();
+    if (Inst->isApply())
+        countExecution(Profile::APPLY, Inst->OrigIdx);
+
     switch (Inst->OpNum) {
 
-        case CONST0: makeCall1("constInt", ConstInt(Val_int(0))); break;
-        case CONST1: makeCall1("constInt", ConstInt(Val_int(1))); break;
-        case CONST2: makeCall1("constInt", ConstInt(Val_int(2))); break;
-        case CONST3: makeCall1("constInt", ConstInt(Val_int(3))); break;
-        case CONSTINT: makeCall1("constInt", ConstInt(Val_int(Inst->Args[0]))); break;
+        case CONST0: setAccu(ConstInt(Val_int(0))); break;
+        case CONST1: setAccu(ConstInt(Val_int(1))); break;
+        case CONST2: setAccu(ConstInt(Val_int(2))); break;
+        case CONST3: setAccu(ConstInt(Val_int(3))); break;
+        case CONSTINT: setAccu(ConstInt(Val_int(Inst->Args[0]))); break;
 
-        case PUSHCONST0: push(); makeCall1("constInt", ConstInt(Val_int(0))); break;
-        case PUSHCONST1: push(); makeCall1("constInt", ConstInt(Val_int(1))); break;
-        case PUSHCONST2: push(); makeCall1("constInt", ConstInt(Val_int(2))); break;
-        case PUSHCONST3: push(); makeCall1("constInt", ConstInt(Val_int(3))); break;
-        case PUSHCONSTINT: push(); makeCall1("constInt", ConstInt(Val_int(Inst->Args[0]))); break;
+        case PUSHCONST0: push(); setAccu(ConstInt(Val_int(0))); break;
+        case PUSHCONST1: push(); setAccu(ConstInt(Val_int(1))); break;
+        case PUSHCONST2: push(); setAccu(ConstInt(Val_int(2))); break;
+        case PUSHCONST3: push(); setAccu(ConstInt(Val_int(3))); break;
+        case PUSHCONSTINT: push(); setAccu(ConstInt(Val_int(Inst->Args[0]))); break;
 
-        case POP: makeCall1("pop", ConstInt(Inst->Args[0])); break;
+        case POP: pop(Inst->Args[0]); break;
 
         case PUSH: push(); break;
         case PUSH_RETADDR: makeCall0("pushRetAddr"); break; 
 
-        // TODO
-        case PUSHTRAP: {
-            auto Buf = Builder->CreateCall(getFunction("getNewBuffer")); 
-            auto SetJmpFunc = getFunction("__sigsetjmp"); 
-            auto JmpBufType = Function->Module->TheModule->getTypeByName("struct.__jmp_buf_tag")->getPointerTo();
-            auto JmpBuf = Builder->CreateBitCast(Buf, JmpBufType);
-            auto Const0 = ConstantInt::get(getGlobalContext(), APInt(32, 0, true));
-            auto SetJmpRes = Builder->CreateCall2(SetJmpFunc, JmpBuf, Const0);
-            auto BoolVal = Builder->CreateIntCast(SetJmpRes, Type::getInt1Ty(getGlobalContext()), getValType());
-            auto Blocks = addBlock();
-            auto TrapBlock = Function->Blocks[Inst->Args[0]];
-            Builder->CreateCondBr(BoolVal, TrapBlock->LlvmBlocks.front(), Blocks.second);
-
-            Builder->SetInsertPoint(TrapBlock->LlvmBlock);
-            makeCall0("getExceptionValue");
-            makeCall0("removeExceptionContext");
-
-            Builder->SetInsertPoint(Blocks.second);
-
-            makeCall0("pushTrap");
-            break;
-
-        }
-
-        case POPTRAP:
-            makeCall0("removeExceptionContext");
-            makeCall0("popTrap");
-            break;
-
-        case RAISE: 
+        // The handler block reads the exception from the trap frame
+        case PUSHTRAP: makeCall0("pushTrap"); break;
+        case POPTRAP: makeCall0("popTrap"); break;
+
+        case RAISE: {
+            // Raising to a handler of the same function is a jump
+            if (inTryBlock()) {
+                Builder->CreateStore(getAccu(), getGlobalVariable("caml_exn_bucket"));
+                syncStack();
+                Builder->CreateBr(Function->blockAt(CurState.Traps.back())->LlvmBlocks.front());
+                break;
+            }
             makeCall1("throwException", getAccu());
-            Builder->CreateRetVoid();
+            Builder->CreateUnreachable();
             break;
+        }
 
         case ACC0:  acc(0); break;
         case ACC1:  acc(1); break;
@@ -312,42 +1045,46 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
         case PUSHENVACC4: push(); envAcc(4); break;
         case PUSHENVACC:  push(); envAcc(Inst->Args[0]); break;
 
-        case ADDINT: makeCall0("addInt"); break;
-        case NEGINT: makeCall0("negInt"); break;
-        case SUBINT: makeCall0("subInt"); break;
-        case MULINT: makeCall0("mulInt"); break;
-        case DIVINT: makeCall0("divInt"); break;
-        case MODINT: makeCall0("modInt"); break;
-        case OFFSETINT: makeCall1("offsetInt", ConstInt(Inst->Args[0] << 1)); break;
-        case ANDINT: makeCall0("andInt"); break;
-        case ORINT: makeCall0("orInt"); break;
-        case XORINT: makeCall0("xorInt"); break;
-        case LSLINT: makeCall0("lslInt"); break;
-        case LSRINT: makeCall0("lsrInt"); break;
-        case ASRINT: makeCall0("asrInt"); break;
-        case BOOLNOT: makeCall0("boolNot"); break;
-        case ISINT: makeCall0("isInt"); break;
+        case ADDINT:
+        case NEGINT:
+        case SUBINT:
+        case MULINT:
+        case OFFSETINT:
+        case ANDINT:
+        case ORINT:
+        case XORINT:
+        case LSLINT:
+        case LSRINT:
+        case ASRINT:
+        case BOOLNOT:
+        case ISINT:
+            makeIntOp(Inst); break;
+
+        case DIVINT:
+        case MODINT:
+            makeDivOp(Inst); break;
 
         case OFFSETREF: makeCall1("offsetRef",ConstInt(Inst->Args[0])); break;
 
-        case GEINT: makeCall0("geInt"); break;
-        case LTINT: makeCall0("ltInt"); break;
-        case LEINT: makeCall0("leInt"); break;
-        case ULTINT: makeCall0("ultInt"); break;
-        case UGEINT: makeCall0("ugeInt"); break;
-        case GTINT: makeCall0("gtInt"); break;
-        case NEQ: makeCall0("cmpNeq"); break;
-        case EQ: makeCall0("cmpEq"); break;
+        case GEINT:
+        case LTINT:
+        case LEINT:
+        case ULTINT:
+        case UGEINT:
+        case GTINT:
+        case NEQ:
+        case EQ:
+            makeIntCmp(Inst); break;
 
-        case ASSIGN: makeCall1("assign", ConstInt(Inst->Args[0])); break;
+        case ASSIGN: assign(Inst->Args[0]); break;
 
         case PUSHGETGLOBAL: push();
-        case GETGLOBAL: makeCall1("getGlobal", ConstInt(Inst->Args[0])); break;
+        case GETGLOBAL: makeGetGlobal(Inst->Args[0]); break;
         case SETGLOBAL: makeCall1("setGlobal", ConstInt(Inst->Args[0])); break;
 
         case PUSHGETGLOBALFIELD: push();
         case GETGLOBALFIELD: 
-            makeCall1("getGlobal", ConstInt(Inst->Args[0]));
+            makeGetGlobal(Inst->Args[0]);
             makeGetField(Inst->Args[1]);
             break;
 
@@ -357,10 +1094,15 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
         case PUSHATOM: push();
         case ATOM: makeCall1("getAtom", ConstInt(Inst->Args[0])); break;
 
-        case MAKEBLOCK1: makeCall1("makeBlock1", ConstInt(Inst->Args[0])); break;
-        case MAKEBLOCK2: makeCall1("makeBlock2", ConstInt(Inst->Args[0])); break;
-        case MAKEBLOCK3: makeCall1("makeBlock3", ConstInt(Inst->Args[0])); break;
-        case MAKEBLOCK: makeCall2("makeBlock", ConstInt(Inst->Args[1]), ConstInt(Inst->Args[0])); break;
+        case MAKEBLOCK1: makeBlockAlloc(1, Inst->Args[0]); break;
+        case MAKEBLOCK2: makeBlockAlloc(2, Inst->Args[0]); break;
+        case MAKEBLOCK3: makeBlockAlloc(3, Inst->Args[0]); break;
+        case MAKEBLOCK:
+            if (Inst->Args[0] <= Max_young_wosize)
+                makeBlockAlloc(Inst->Args[0], Inst->Args[1]);
+            else
+                makeCall2("makeBlock", ConstInt(Inst->Args[1]), ConstInt(Inst->Args[0]));
+            break;
         case MAKEFLOATBLOCK: makeCall1("makeFloatBlock", ConstInt(Inst->Args[0])); break;
 
         case SETFIELD0: makeSetField(0); break;
@@ -375,7 +1117,7 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
         case GETFIELD2: makeGetField(2); break;
         case GETFIELD3: makeGetField(3); break;
         case GETFIELD:  makeGetField(Inst->Args[0]); break;
-        case GETFLOATFIELD: makeCall1("getDoubleField", ConstInt(Inst->Args[0])); break;
+        case GETFLOATFIELD: makeGetFloatField(Inst->Args[0]); break;
 
         case VECTLENGTH: makeCall0("vectLength"); break;
         case GETVECTITEM: makeCall0("getVectItem"); break;
@@ -385,31 +1127,27 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
         case SETSTRINGCHAR: makeCall0("setStringChar"); break; 
 
         // Closure related Instructions
-        case CLOSUREREC:
-            makeCall3("closureRec", ConstInt(Inst->Args[0]), ConstInt(Inst->Args[1]), getPtrToFunc(Inst->ClosureRecFns[0]));
-            for (int i = 1; i < Inst->Args[0]; i++)
-                makeCall2("setClosureRecNestedClos", ConstInt(i), getPtrToFunc(Inst->ClosureRecFns[i]));
-            break;
-
-        case CLOSURE:
-            makeCall2("closure", ConstInt(Inst->Args[0]), getPtrToFunc(Inst->Args[1]));
-            break;
+        case CLOSUREREC: makeClosureRec(Inst); break;
+        case CLOSURE: makeClosure(Inst->Args[0], Inst->Args[1]); break;
 
         case PUSHOFFSETCLOSURE: push();
-        case OFFSETCLOSURE: makeCall1("offsetClosure", ConstInt(Inst->Args[0])); break;
+        case OFFSETCLOSURE: makeOffsetClosure(Inst->Args[0]); break;
 
         case PUSHOFFSETCLOSUREM2: push();
-        case OFFSETCLOSUREM2: makeCall1("offsetClosure", ConstInt(-2)); break;
+        case OFFSETCLOSUREM2: makeOffsetClosure(-2); break;
 
         case PUSHOFFSETCLOSURE0: push();
-        case OFFSETCLOSURE0: makeCall1("offsetClosure", ConstInt(0)); break;
+        case OFFSETCLOSURE0: makeOffsetClosure(0); break;
 
         case PUSHOFFSETCLOSURE2: push();
-        case OFFSETCLOSURE2: makeCall1("offsetClosure", ConstInt(2)); break;
+        case OFFSETCLOSURE2: makeOffsetClosure(2); break;
 
         case GRAB: {
+            // The native entry is only called with the exact arity
+            if (Function->Native) break;
+
             auto BoolVal = Builder->CreateIntCast(makeCall1("checkGrab", ConstInt(Inst->Args[0])),
-                                                  Type::getInt1Ty(getGlobalContext()), getValType());
+                                                  Type::getInt1Ty(getCodeGenContext()), getValType());
             auto Blocks = addBlock();
             auto BlockReturn = Blocks.second;
             Blocks = addBlock();
@@ -419,8 +1157,7 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
             // Code for the creation of a partial closure
             Builder->SetInsertPoint(BlockReturn);
 
-            auto ResFuncPtr = Builder->CreatePtrToInt(Function->RestartFunction, getValType());
-            makeCall1("createRestartClosure", ResFuncPtr);
+            makeCall1("createRestartClosure", Function->getClosureCode(true));
             Builder->CreateRetVoid();
 
             // Code for continue
@@ -445,49 +1182,106 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
         case C_CALLN: makeCall2("c_calln", ConstInt(Inst->Args[0]), ConstInt(Inst->Args[1])); break;
 
         case APPLY1: {
-            Builder->CreateCall(makeCall0("apply1"))->setCallingConv(CallingConv::Fast);
+            if (auto Target = getNativeTarget(1)) {
+                makeNativeCall(Target, 1, 0);
+                break;
+            }
+            createCall(getCallee(makeCall0("apply1")), ArrayRef<Value*>(), true);
             break;
         }
         case APPLY2: {
-            Builder->CreateCall(makeCall0("apply2"))->setCallingConv(CallingConv::Fast);
+            if (auto Target = getNativeTarget(2)) {
+                makeNativeCall(Target, 2, 0);
+                break;
+            }
+            createCall(getCallee(makeCall0("apply2")), ArrayRef<Value*>(), true);
             break;
         }
         case APPLY3: {
-            Builder->CreateCall(makeCall0("apply3"))->setCallingConv(CallingConv::Fast);
+            if (auto Target = getNativeTarget(3)) {
+                makeNativeCall(Target, 3, 0);
+                break;
+            }
+            createCall(getCallee(makeCall0("apply3")), ArrayRef<Value*>(), true);
             break;
         }
         case APPLY: {
-            Builder->CreateCall(makeCall1("apply", ConstInt(Inst->Args[0])))->setCallingConv(CallingConv::Fast);
+            // The return frame was pushed by PUSH_RETADDR
+            if (auto Target = getNativeTarget(Inst->Args[0])) {
+                makeNativeCall(Target, Inst->Args[0], 3);
+                break;
+            }
+            createCall(getCallee(makeCall1("apply", ConstInt(Inst->Args[0]))), ArrayRef<Value*>(), true);
             break;
         }
 
         case APPTERM1: {
+            if (Function->Native) {
+                auto Target = getNativeTarget(1);
+                if (Target == Function)
+                    makeSelfTailCall(1, Inst->Args[0]);
+                else if (Target)
+                    makeNativeTailCall(Target, 1, Inst->Args[0]);
+                else
+                    makeNativeApplyTerm(1, Inst->Args[0]);
+                break;
+            }
             auto Func = makeCall1("appterm1", ConstInt(Inst->Args[0])); 
-            auto Call = Builder->CreateCall(Func);
+            auto Call = Builder->CreateCall(getCallee(Func));
             Call->setCallingConv(CallingConv::Fast);
             Call->setTailCall();
             Builder->CreateRetVoid();
             break;
         }
         case APPTERM2: {
+            if (Function->Native) {
+                auto Target = getNativeTarget(2);
+                if (Target == Function)
+                    makeSelfTailCall(2, Inst->Args[0]);
+                else if (Target)
+                    makeNativeTailCall(Target, 2, Inst->Args[0]);
+                else
+                    makeNativeApplyTerm(2, Inst->Args[0]);
+                break;
+            }
             auto Func = makeCall1("appterm2", ConstInt(Inst->Args[0])); 
-            auto Call = Builder->CreateCall(Func);
+            auto Call = Builder->CreateCall(getCallee(Func));
             Call->setCallingConv(CallingConv::Fast);
             Call->setTailCall();
             Builder->CreateRetVoid();
             break;
         }
         case APPTERM3: {
+            if (Function->Native) {
+                auto Target = getNativeTarget(3);
+                if (Target == Function)
+                    makeSelfTailCall(3, Inst->Args[0]);
+                else if (Target)
+                    makeNativeTailCall(Target, 3, Inst->Args[0]);
+                else
+                    makeNativeApplyTerm(3, Inst->Args[0]);
+                break;
+            }
             auto Func = makeCall1("appterm3", ConstInt(Inst->Args[0])); 
-            auto Call = Builder->CreateCall(Func);
+            auto Call = Builder->CreateCall(getCallee(Func));
             Call->setCallingConv(CallingConv::Fast);
             Call->setTailCall();
             Builder->CreateRetVoid();
             break;
         }
         case APPTERM: {
+            if (Function->Native) {
+                auto Target = getNativeTarget(Inst->Args[0]);
+                if (Target == Function)
+                    makeSelfTailCall(Inst->Args[0], Inst->Args[1]);
+                else if (Target)
+                    makeNativeTailCall(Target, Inst->Args[0], Inst->Args[1]);
+                else
+                    makeNativeApplyTerm(Inst->Args[0], Inst->Args[1]);
+                break;
+            }
             auto Func = makeCall2("appterm", ConstInt(Inst->Args[0]), ConstInt(Inst->Args[1])); 
-            auto Call = Builder->CreateCall(Func);
+            auto Call = Builder->CreateCall(getCallee(Func));
             Call->setCallingConv(CallingConv::Fast);
             Call->setTailCall();
             Builder->CreateRetVoid();
@@ -497,9 +1291,15 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
         // Fall through return
         // TODO
         case STOP:
+            syncStack();
             Builder->CreateRetVoid();
             break;
         case RETURN: {
+            if (Function->Native) {
+                pop(Inst->Args[0]);
+                makeReturn();
+                break;
+            }
             auto Func = makeCall1("handleReturn", ConstInt(Inst->Args[0]));
             auto IntPtr = Builder->CreatePtrToInt(Func, getValType());
             auto BoolVal = Builder->CreateICmpNE(IntPtr, ConstInt(0), "BranchRet");
@@ -510,7 +1310,7 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
             Builder->CreateCondBr(BoolVal, BlockInvoke, BlockReturn);
 
             Builder->SetInsertPoint(BlockInvoke);
-            auto Call = Builder->CreateCall(Func);
+            auto Call = Builder->CreateCall(getCallee(Func));
             Call->setCallingConv(CallingConv::Fast);
             Call->setTailCall();
             Builder->CreateRetVoid();
@@ -522,47 +1322,74 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
         }
 
         case BRANCH:{
-            BasicBlock* LBrBlock = BrBlock->LlvmBlock;
+            syncStack(true);
+            BasicBlock* LBrBlock = BrBlock->LlvmBlocks.front();
             Builder->CreateBr(LBrBlock);
             break;
         }
         case BRANCHIF: {
-            auto BoolVal = Builder->CreateICmpNE(getAccu(), ConstInt(Val_false), "BranchCmp");
-            Builder->CreateCondBr(BoolVal, BrBlock->LlvmBlocks.front(), NoBrBlock->LlvmBlocks.front());
+            auto BoolVal = getCond();
+            syncStack(true);
+            auto Br = Builder->CreateCondBr(BoolVal, BrBlock->LlvmBlocks.front(), NoBrBlock->LlvmBlocks.front());
+            setBranchWeights(Br, BrBlock, NoBrBlock);
             break;
         }
         case BRANCHIFNOT: {
-            auto BoolVal = Builder->CreateICmpNE(getAccu(), ConstInt(Val_false), "BranchCmp");
-            Builder->CreateCondBr(BoolVal, NoBrBlock->LlvmBlocks.front(), BrBlock->LlvmBlocks.front());
+            auto BoolVal = getCond();
+            syncStack(true);
+            auto Br = Builder->CreateCondBr(BoolVal, NoBrBlock->LlvmBlocks.front(), BrBlock->LlvmBlocks.front());
+            setBranchWeights(Br, NoBrBlock, BrBlock);
             break;
         }
         case SWITCH: {
             auto SwitchVal = Builder->CreateCall2(getFunction("getSwitchOffset"),
                                                   ConstInt(Inst->Args[0]),
                                                   getAccu());
-            auto DefaultBlock = Function->Blocks[Inst->SwitchEntries[0]];
-            this->setNext(DefaultBlock, false);
-            auto Switch = Builder->CreateSwitch(SwitchVal, DefaultBlock->LlvmBlock);
-            for (size_t i = 0; i < Inst->SwitchEntries.size(); i++)
-                Switch->addCase(ConstInt(i), Function->Blocks[Inst->SwitchEntries[i]]->LlvmBlock);
+            syncStack(true);
+            auto Entries = Inst->switchEntries();
+            auto DefaultBlock = Function->blockAt(Entries[0]);
+            auto Switch = Builder->CreateSwitch(SwitchVal, DefaultBlock->LlvmBlocks.front());
+            for (size_t i = 0; i < Entries.size(); i++)
+                Switch->addCase(ConstInt(i), Function->blockAt(Entries[i])->LlvmBlocks.front());
 
             break;
         }
 
 
-        case BEQ: TmpVal = Builder->CreateICmpEQ(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
-        case BNEQ: TmpVal = Builder->CreateICmpNE(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
-        case BLTINT: TmpVal = Builder->CreateICmpSLT(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
-        case BLEINT: TmpVal = Builder->CreateICmpSLE(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
-        case BGTINT: TmpVal = Builder->CreateICmpSGT(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
-        case BGEINT: TmpVal = Builder->CreateICmpSGE(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
-        case BULTINT: TmpVal = Builder->CreateICmpULT(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
-        case BUGEINT: TmpVal = Builder->CreateICmpUGE(ConstInt(Val_int(Inst->Args[0])), getAccu()); goto makebr;
+        case BEQ:
+        case BNEQ:
+        case BLTINT:
+        case BLEINT:
+        case BGTINT:
+        case BGEINT:
+        case BULTINT:
+        case BUGEINT: {
+            Value* Cst = ConstInt(Val_int(Inst->Args[0]));
+            Value* Val = getAccu();
+            if (hasUntagged(Val)) {
+                Cst = ConstInt(Inst->Args[0]);
+                Val = getUntagged(Val);
+            }
+
+            switch (Inst->OpNum) {
+                case BEQ: TmpVal = Builder->CreateICmpEQ(Cst, Val); break;
+                case BNEQ: TmpVal = Builder->CreateICmpNE(Cst, Val); break;
+                case BLTINT: TmpVal = Builder->CreateICmpSLT(Cst, Val); break;
+                case BLEINT: TmpVal = Builder->CreateICmpSLE(Cst, Val); break;
+                case BGTINT: TmpVal = Builder->CreateICmpSGT(Cst, Val); break;
+                case BGEINT: TmpVal = Builder->CreateICmpSGE(Cst, Val); break;
+                case BULTINT: TmpVal = Builder->CreateICmpULT(Cst, Val); break;
+                default: TmpVal = Builder->CreateICmpUGE(Cst, Val); break;
+            }
+            goto makebr;
+        }
 
         makebr: {
+            syncStack(true);
             BasicBlock* LBrBlock = BrBlock->LlvmBlocks.front();
             BasicBlock* LNoBrBlock = NoBrBlock->LlvmBlocks.front();
-            Builder->CreateCondBr(TmpVal, LBrBlock, LNoBrBlock);
+            auto Br = Builder->CreateCondBr(TmpVal, LBrBlock, LNoBrBlock);
+            setBranchWeights(Br, BrBlock, NoBrBlock);
             break;
         }
 
@@ -577,6 +1404,9 @@ void GenBlock::GenCodeForInst(ZInstruction* Inst) {
 
     }
 
+    if (ColdSite)
+        markColdCalls(SiteBlock, SiteInst);
+
     //DEBUG(cout << "Stack DIFF : " << StackSize - Stack.size() << endl;)
     DEBUG(cout << "Instruction generated ===  \n";)
 }
@@ -601,6 +1431,9 @@ void GenBlock::PrintAdjBlocks() {
     for (auto Block : NextBlocks)
         cout << Block->Id << " ";
 
+    if (Idom) cout << " | Idom : " << Idom->Id;
+    if (LoopHeader) cout << " | Loop : " << LoopHeader->Id << " depth " << LoopDepth;
+
     cout << "\n";
 }
 
@@ -609,14 +1442,162 @@ Function* GenBlock::getFunction(string Name) {
 }
 
 
+/*
+ * Code pointer of a closure. The code of the function is generated by
+ * the JIT on its first call, the pointer may be a lazy stub until then.
+ */
 llvm::Value* GenBlock::getPtrToFunc(int32_t FnId) {
-    auto DestGenFunc = Function->Module->Functions[FnId];
+    return Function->Module->Functions[FnId]->getClosureCode();
+}
+
+/*
+ * Function of the closure in the accumulator, when it is statically known
+ */
+GenFunction* GenBlock::getKnownTarget() {
+    if (CurState.Accu < 0)
+        return nullptr;
+    return Function->Module->Functions[CurState.Accu];
+}
 
-    if (DestGenFunc->LlvmFunc == NULL)
-        DestGenFunc->CodeGen();
+/*
+ * Function to call after an apply helper returned CodePtr.
+ * When the closure in the accumulator is known, its function is
+ * called directly, so that llvm can see the call target.
+ */
+llvm::Value* GenBlock::getCallee(llvm::Value* CodePtr) {
+    auto Target = getKnownTarget();
+    return Target ? Target->getLlvmFunc() : CodePtr;
+}
 
-    Builder->SetInsertPoint(LlvmBlock);
-    auto ClosureFunc = DestGenFunc->LlvmFunc;
-    
-    return Builder->CreatePtrToInt(ClosureFunc, getValType());
+// ================ Native calling convention ================== //
+
+/*
+ * Functions with a native entry take their closure and arguments as
+ * llvm parameters and return their result. They are called this way
+ * when the callee is known and gets exactly its arity, which needs no
+ * return frame on the ZAM stack. Other calls go through the ZAM entry.
+ */
+
+GenFunction* GenBlock::getNativeTarget(int NArgs) {
+    auto Target = getKnownTarget();
+    if (Target && Target->Arity == NArgs && Target->hasNativeEntry())
+        return Target;
+    return nullptr;
+}
+
+/*
+ * Calls Target with the NArgs arguments on top of the stack. FrameSize
+ * words below them are popped after the call.
+ */
+void GenBlock::makeNativeCall(GenFunction* Target, int NArgs, int FrameSize) {
+    vector<Value*> Args;
+    Args.push_back(getAccu());
+    for (int i = 0; i < NArgs; i++)
+        Args.push_back(getStackAt(i));
+    pop(NArgs);
+
+    // Exception handlers read the stack from memory
+    if (inTryBlock())
+        syncStack();
+
+    // Values in memory are updated by the GC, and read again when needed
+    for (size_t i = 0; i < Stack.size(); i++)
+        if (Stack[i] && !Stack[i]->Dirty && isPointerVal(Stack[i]->Val))
+            Stack[i] = nullptr;
+
+    // The rest of the virtual stack stays in registers, with the
+    // environment of the caller
+    auto SavedEnv = Builder->CreateLoad(getGlobalVariable("Env"));
+    Value* Extra[] = { SavedEnv };
+    auto Roots = saveRoots(false, Extra);
+
+    auto Call = createCall(Target->getNativeFunc(), Args, true);
+
+    // The callee may have reallocated the ZAM stack
+    Sp = nullptr;
+
+    restoreRoots(Roots);
+    for (size_t i = 0; i < Roots.Keys.size(); i++)
+        setRootedVal(Roots.Keys[i], Roots.Vals[i]);
+    Builder->CreateStore(Roots.Vals.back(), getGlobalVariable("Env"));
+    AtEntry = false;
+
+    pop(FrameSize);
+    setAccu(Call);
+}
+
+/*
+ * Tail call from a native entry to Target, with the NArgs arguments
+ * on top of the SlotSize words of the current frame
+ */
+void GenBlock::makeNativeTailCall(GenFunction* Target, int NArgs, int SlotSize) {
+    vector<Value*> Args;
+    Args.push_back(getAccu());
+    for (int i = 0; i < NArgs; i++)
+        Args.push_back(getStackAt(i));
+    pop(SlotSize);
+    syncStack(true);
+
+    auto Call = Builder->CreateCall(Target->getNativeFunc(), Args);
+    Call->setCallingConv(CallingConv::Fast);
+    Call->setTailCall();
+    Builder->CreateRet(Call);
+}
+
+/*
+ * Tail call of a native entry to itself: a jump back to the first block,
+ * with the new closure and arguments as values of its parameters
+ */
+void GenBlock::makeSelfTailCall(int NArgs, int SlotSize) {
+    vector<Value*> Args;
+    Args.push_back(getAccu());
+    for (int i = 0; i < NArgs; i++)
+        Args.push_back(getStackAt(i));
+    pop(SlotSize);
+    syncStack(true);
+
+    auto& Params = Function->NativeParams;
+    for (size_t i = 0; i < Params.size(); i++)
+        Params[i]->addIncoming(Args[i], Builder->GetInsertBlock());
+    Builder->CreateBr(Function->FirstBlock->LlvmBlocks.front());
+}
+
+/*
+ * APPTERM from a native entry to an unknown closure. A native entry has
+ * to return the result, so the ZAM entry of the closure is called with
+ * a return frame in place of the current frame, as APPLY would do.
+ */
+void GenBlock::makeNativeApplyTerm(int NArgs, int SlotSize) {
+    auto Closure = getAccu();
+    vector<Value*> Args;
+    for (int i = 0; i < NArgs; i++)
+        Args.push_back(getStackAt(i));
+    pop(SlotSize);
+
+    auto ExtraArgs = Builder->CreateLoad(getGlobalVariable("extra_args"));
+    pushValue(valInt(ExtraArgs));
+    pushValue(Builder->CreateLoad(getGlobalVariable("Env")));
+    pushValue(ConstInt(Val_unit));
+    for (int i = NArgs - 1; i >= 0; i--)
+        pushValue(Args[i]);
+
+    setAccu(Closure);
+    auto Func = makeCall1("apply", ConstInt(NArgs));
+    createCall(getCallee(Func), ArrayRef<Value*>(), true);
+    makeReturn();
+}
+
+/*
+ * Leaves the function once the stack is back to the caller's frame.
+ * The native entry returns the accumulator.
+ */
+void GenBlock::makeReturn() {
+    if (Function->Native) {
+        auto Val = getAccu();
+        syncStack(true);
+        Builder->CreateRet(Val);
+    } else {
+        syncStack(true);
+        Builder->CreateRetVoid();
+    }
 }
@@ -1,7 +1,18 @@
 #include <Utils.hpp>
 #include <CodeGen.hpp>
+#include <Timing.hpp>
 #include "llvm/Analysis/Verifier.h"
+#include "llvm/Analysis/Dominators.h"
 #include "llvm/LLVMContext.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+extern "C" {
+    #include <ocaml_runtime/mlvalues.h>
+    #include <ocaml_runtime/memory.h>
+    #include <ocaml_runtime/fix_code.h>
+}
 
 using namespace std;
 using namespace llvm;
@@ -12,20 +23,30 @@ GenFunction::GenFunction(int Id, GenModule* Module) {
     this->Id = Id;
     this->Module = Module;
     this->LlvmFunc = nullptr;
+    this->RestartFunction = nullptr;
+    this->NativeFunc = nullptr;
+    this->Native = false;
+    this->EntryBlock = nullptr;
+    this->RootSlots = nullptr;
+    this->RootsBlock = nullptr;
+    this->MaxRoots = 0;
+    this->Generated = false;
+    this->RecIndex = 0;
+    this->CodeOffset = 0;
 }
 
 void GenFunction::Print() {
-    for (auto BlockP : Blocks) {
+    for (auto Block : Blocks) {
         printTab(1);
-        cout << "Block " << BlockP.first << ":" << endl;
-        BlockP.second->Print();
+        cout << "Block " << Block->Id << ":" << endl;
+        Block->Print();
     }
 }
 
 void GenFunction::PrintBlocks() {
-    for (auto BlockP : Blocks) {
+    for (auto Block : Blocks) {
         printTab(1);
-        cout << "Block " << BlockP.first;
+        cout << "Block " << Block->Id;
     }
 }
 
@@ -36,47 +57,348 @@ string GenFunction::name() {
 }
 
 
-Function* GenFunction::CodeGen() {
+/*
+ * Returns the llvm Function, creating its declaration if needed,
+ * so that it can be called before its body is generated
+ */
+Function* GenFunction::getLlvmFunc() {
+    if (LlvmFunc) return LlvmFunc;
 
     // Make function type
-    auto FT = FunctionType::get(Type::getVoidTy(getGlobalContext()), false);
+    auto FT = FunctionType::get(Type::getVoidTy(getCodeGenContext()), false);
 
     // Create the llvm Function object
     LlvmFunc = Function::Create(FT, Function::ExternalLinkage, name(), Module->TheModule);
-    
+    Module->GenFunctions[LlvmFunc] = this;
+
     if (Id != 0) // is not main function
         LlvmFunc->setCallingConv(CallingConv::Fast);
 
+    return LlvmFunc;
+}
+
+/*
+ * Returns the native entry of the function, creating its declaration
+ * if needed. It takes the closure and the Arity arguments, and returns
+ * the result of the function.
+ */
+Function* GenFunction::getNativeFunc() {
+    if (NativeFunc) return NativeFunc;
+
+    vector<Type*> ArgTypes(Arity + 1, getValType());
+    auto FT = FunctionType::get(getValType(), ArgTypes, false);
+    NativeFunc = Function::Create(FT, Function::ExternalLinkage, name() + "_Native", Module->TheModule);
+    NativeFunc->setCallingConv(CallingConv::Fast);
+    Module->GenFunctions[NativeFunc] = this;
+
+    return NativeFunc;
+}
+
+/*
+ * Offset in words of the first instruction of the function in the
+ * CODE section
+ */
+int32_t GenFunction::codeOffset() {
+    return CodeOffset;
+}
+
+/*
+ * Code pointer stored in the closures of the function, or in its partial
+ * applications if Restart. In mixed mode it is the bytecode, which the
+ * interpreter can run, and which the JIT maps to the compiled code.
+ */
+Constant* GenFunction::getClosureCode(bool Restart) {
+    if (Module->Mixed) {
+        // The RESTART instruction precedes the GRAB of the function
+        auto Code = caml_start_code + codeOffset() - (Restart ? 1 : 0);
+        return ConstantInt::get(getValType(), (intptr_t)Code);
+    }
+    auto Func = Restart ? RestartFunction : getLlvmFunc();
+    return ConstantExpr::getPtrToInt(Func, getValType());
+}
+
+/*
+ * The arguments of the native entry are pushed on the virtual stack at
+ * the start of the first block, so it must not be the target of a jump
+ */
+bool GenFunction::hasNativeEntry() {
+    return Id != MAIN_FUNCTION_ID && FirstBlock->PreviousBlocks.size() == 0;
+}
+
+Function* GenFunction::CodeGen() {
+
+    Generated = true;
+    getLlvmFunc();
+    Native = hasNativeEntry();
+    auto BodyFunc = Native ? getNativeFunc() : LlvmFunc;
+
     // If not main function, initialize restart helper func
     if (Id != MAIN_FUNCTION_ID) {
-        auto FT = FunctionType::get(Type::getVoidTy(getGlobalContext()), false);
+        auto FT = FunctionType::get(Type::getVoidTy(getCodeGenContext()), false);
         RestartFunction = Function::Create(FT, Function::ExternalLinkage, name() + "_Restart", Module->TheModule);
         this->generateRestartFunction();
     }
 
     //FirstBlock->addCallInfo();
 
-    // Generate each block and put it in the function's list of blocks
-    for (auto BlockP : Blocks) {
-        BlockP.second->CodeGen();
-        BlockP.second->genTermInst();
+    computeAccuLiveness();
+    computeStackStates();
+
+    EntryBlock = BasicBlock::Create(getCodeGenContext(), "Entry", BodyFunc);
+    // Native calls don't go through the apply helpers, which grow
+    // the ZAM stack when it reaches its threshold
+    if (Native)
+        CallInst::Create(Module->getFunction("checkStacks"), "", EntryBlock);
+    BranchInst::Create(FirstBlock->LlvmBlocks.front(), EntryBlock);
+
+    // Generate each block and put it in the function's list of blocks.
+    // The blocks that never ran in the profiled run go after the others.
+    vector<BasicBlock*> ColdBlocks;
+    for (auto Block : Blocks) {
+        Block->CodeGen();
+        Block->genTermInst();
         //DEBUG(BlockP.second->dumpStack();)
-        for (auto BBlock : BlockP.second->LlvmBlocks)
-            LlvmFunc->getBasicBlockList().push_back(BBlock);
+        bool Cold = Block->isCold();
+        if (Cold) {
+            Block->markColdCalls();
+            Timing::count("cold blocks", 1);
+        }
+        for (auto BBlock : Block->LlvmBlocks) {
+            if (Cold) ColdBlocks.push_back(BBlock);
+            else BodyFunc->getBasicBlockList().push_back(BBlock);
+        }
     }
+    for (auto BBlock : ColdBlocks)
+        BodyFunc->getBasicBlockList().push_back(BBlock);
 
+    for (auto PadP : LandingPads)
+        BodyFunc->getBasicBlockList().push_back(PadP.second);
 
+    // Filling phi nodes can create new ones in the predecessors,
+    // so iterate until every block is done
+    bool Filled = true;
+    while (Filled) {
+        Filled = false;
+        for (auto Block : Blocks)
+            Filled |= Block->fillPHINodes();
+    }
+
+
+    if (Native)
+        generateZamEntry();
 
     // Verify if the function is well formed
-    verifyFunction(*LlvmFunc);
+    verifyFunction(*BodyFunc);
 
     return LlvmFunc;
 }
 
+/*
+ * Backward dataflow computing, for every block, if the accumulator
+ * value at block exit can be read by a successor.
+ * Exception handlers get their accumulator from the raised exception,
+ * so they don't keep the accumulator of the block installing them alive.
+ */
+void GenFunction::computeAccuLiveness() {
+    for (auto Block : Blocks) {
+        Block->AccuLiveOut = false;
+        Block->AccuLiveIn = false;
+    }
+
+    bool Changed = true;
+    while (Changed) {
+        Changed = false;
+        for (auto BlockIt = Blocks.rbegin(); BlockIt != Blocks.rend(); BlockIt++) {
+            auto Block = *BlockIt;
+
+            bool LiveOut = false;
+            for (auto NextBlock : Block->NextBlocks)
+                if (!NextBlock->IsTrapHandler)
+                    LiveOut |= NextBlock->AccuLiveIn;
+
+            bool LiveIn = LiveOut;
+            for (auto InstIt = Block->Instructions.rbegin();
+                 InstIt != Block->Instructions.rend(); InstIt++) {
+                if ((*InstIt)->overwritesAccu()) LiveIn = false;
+                else if (!(*InstIt)->ignoresAccu()) LiveIn = true;
+            }
+
+            if (LiveIn != Block->AccuLiveIn || LiveOut != Block->AccuLiveOut) {
+                Block->AccuLiveIn = LiveIn;
+                Block->AccuLiveOut = LiveOut;
+                Changed = true;
+            }
+        }
+    }
+}
+
+// ================ Abstract stack analysis ================== //
+
+void StackState::push(int Val) {
+    Slots.push_front(Val);
+    if (Slots.size() > MAX_TRACKED_SLOTS) Slots.pop_back();
+}
+
+void StackState::pop(int n) {
+    for (int i = 0; i < n && Slots.size(); i++)
+        Slots.pop_front();
+}
+
+/*
+ * Id of the function whose closure is at Offset words from the current one,
+ * as computed by OFFSETCLOSURE
+ */
+int GenFunction::closureAtOffset(int Offset) {
+    if (RecGroup.empty())
+        return Offset == 0 ? Id : ABS_UNKNOWN;
+
+    int Idx = RecIndex + Offset / 2;
+    if (Offset % 2 != 0 || Idx < 0 || (size_t)Idx >= RecGroup.size())
+        return ABS_UNKNOWN;
+    return RecGroup[Idx];
+}
+
+void StackState::step(ZInstruction* Inst, GenFunction* Function) {
+    int Effect = Inst->stackEffect();
+
+    if (Inst->pushesAccu()) {
+        push(Accu);
+        Effect--;
+    }
+
+    if (Inst->OpNum == PUSHTRAP)
+        Traps.push_back(Inst->getDestIdx());
+    if (Inst->OpNum == POPTRAP && Traps.size())
+        Traps.pop_back();
+
+    // CLOSUREREC pushes the closures it creates, the last one on top
+    if (Inst->OpNum == CLOSUREREC) {
+        pop(Inst->Args[1] > 0 ? Inst->Args[1] - 1 : 0);
+        for (int i = 0; i < Inst->Args[0]; i++)
+            push(Inst->closureRecFns()[i]);
+        Accu = Inst->closureRecFns()[0];
+        return;
+    }
+
+    if (Effect < 0) pop(-Effect);
+    for (int i = 0; i < Effect; i++) push(ABS_UNKNOWN);
+
+    switch (Inst->OpNum) {
+        case ACC0: case ACC1: case ACC2: case ACC3:
+        case ACC4: case ACC5: case ACC6: case ACC7:
+            Accu = slot(Inst->OpNum - ACC0); break;
+        case PUSHACC0: case PUSHACC1: case PUSHACC2: case PUSHACC3:
+        case PUSHACC4: case PUSHACC5: case PUSHACC6: case PUSHACC7:
+            Accu = slot(Inst->OpNum - PUSHACC0); break;
+        case ACC: case PUSHACC:
+            Accu = slot(Inst->Args[0]); break;
+
+        case ASSIGN:
+            if ((size_t)Inst->Args[0] < Slots.size()) Slots[Inst->Args[0]] = Accu;
+            Accu = ABS_INT;
+            break;
+
+        case CONST0: case CONST1: case CONST2: case CONST3: case CONSTINT:
+        case PUSHCONST0: case PUSHCONST1: case PUSHCONST2:
+        case PUSHCONST3: case PUSHCONSTINT:
+        case NEGINT: case ADDINT: case SUBINT: case MULINT: case DIVINT: case MODINT:
+        case ANDINT: case ORINT: case XORINT: case LSLINT: case LSRINT: case ASRINT:
+        case EQ: case NEQ: case LTINT: case LEINT: case GTINT: case GEINT:
+        case ULTINT: case UGEINT:
+        case OFFSETINT: case ISINT: case BOOLNOT:
+        case VECTLENGTH: case GETSTRINGCHAR:
+            Accu = ABS_INT; break;
+
+        case CLOSURE:
+            Accu = Inst->Args[1]; break;
+
+        case OFFSETCLOSUREM2: case PUSHOFFSETCLOSUREM2:
+            Accu = Function->closureAtOffset(-2); break;
+        case OFFSETCLOSURE0: case PUSHOFFSETCLOSURE0:
+            Accu = Function->closureAtOffset(0); break;
+        case OFFSETCLOSURE2: case PUSHOFFSETCLOSURE2:
+            Accu = Function->closureAtOffset(2); break;
+        case OFFSETCLOSURE: case PUSHOFFSETCLOSURE:
+            Accu = Function->closureAtOffset(Inst->Args[0]); break;
+
+        default:
+            if (!Inst->ignoresAccu()) Accu = ABS_UNKNOWN;
+            break;
+    }
+}
+
+bool StackState::meet(StackState& Other) {
+    if (!Visited) {
+        Slots = Other.Slots;
+        Accu = Other.Accu;
+        Traps = Other.Traps;
+        Visited = true;
+        return true;
+    }
+
+    bool Changed = false;
+    if (Slots.size() > Other.Slots.size()) {
+        Slots.resize(Other.Slots.size());
+        Changed = true;
+    }
+    for (size_t i = 0; i < Slots.size(); i++) {
+        if (Slots[i] != ABS_UNKNOWN && Slots[i] != Other.Slots[i]) {
+            Slots[i] = ABS_UNKNOWN;
+            Changed = true;
+        }
+    }
+    if (Accu != ABS_UNKNOWN && Accu != Other.Accu) {
+        Accu = ABS_UNKNOWN;
+        Changed = true;
+    }
+    return Changed;
+}
+
+/*
+ * Forward dataflow finding the stack slots and accumulators that hold
+ * an immediate int, or a closure of a known function, on every path
+ * reaching a block. Ints are joined untagged at block entry, and known
+ * closures are called directly.
+ * Nothing is known at function entry and in exception handlers.
+ */
+void GenFunction::computeStackStates() {
+    for (auto Block : Blocks) {
+        Block->EntryState = StackState();
+        if (Block == FirstBlock || Block->IsTrapHandler)
+            Block->EntryState.Visited = true;
+    }
+
+    bool Changed = true;
+    while (Changed) {
+        Changed = false;
+        for (auto Block : Blocks) {
+            if (!Block->EntryState.Visited) continue;
+
+            StackState State = Block->EntryState;
+            for (auto Inst : Block->Instructions) {
+                // A handler runs with the try blocks enclosing its PUSHTRAP
+                if (Inst->OpNum == PUSHTRAP) {
+                    auto Handler = blockAt(Inst->getDestIdx());
+                    if (Handler->EntryState.Traps != State.Traps) {
+                        Handler->EntryState.Traps = State.Traps;
+                        Changed = true;
+                    }
+                }
+                State.step(Inst, this);
+            }
+            Block->ExitState = State;
+
+            for (auto NextBlock : Block->NextBlocks)
+                if (NextBlock != FirstBlock && !NextBlock->IsTrapHandler)
+                    Changed |= NextBlock->EntryState.meet(State);
+        }
+    }
+}
+
 void GenFunction::generateRestartFunction() {
 
     auto Builder = Module->Builder;
-    auto Block1 = BasicBlock::Create(getGlobalContext());
+    auto Block1 = BasicBlock::Create(getCodeGenContext());
     Builder->SetInsertPoint(Block1);
     Builder->CreateCall(Module->getFunction("restart"));
     auto Call = Builder->CreateCall(LlvmFunc);
@@ -90,28 +412,407 @@ void GenFunction::generateRestartFunction() {
     verifyFunction(*RestartFunction);
 }
 
+// ================ Exception handling ================== //
+
+/*
+ * OCaml exceptions are raised as C++ exceptions by jitRaise, and calls
+ * made in a try block are invokes unwinding to a landing pad of the
+ * handler. The landing pad ends the C++ exception and jumps to the
+ * handler, which gets the OCaml exception from the trap frame.
+ * Nothing is done when entering a try block but pushing the trap frame.
+ */
+BasicBlock* GenFunction::getLandingPad(int HandlerId) {
+    auto PadP = LandingPads.find(HandlerId);
+    if (PadP != LandingPads.end())
+        return PadP->second;
+
+    auto& Context = getCodeGenContext();
+    auto TheModule = Module->TheModule;
+    auto I8PtrTy = Type::getInt8PtrTy(Context);
+    auto I32Ty = Type::getInt32Ty(Context);
+
+    auto Pad = BasicBlock::Create(Context, "LandingPad");
+    IRBuilder<> PadBuilder(Pad);
+
+    auto PersonalityFT = FunctionType::get(I32Ty, true);
+    auto Personality = TheModule->getOrInsertFunction("__gxx_personality_v0", PersonalityFT);
+    auto ExnTy = StructType::get(I8PtrTy, I32Ty, NULL);
+    auto LP = PadBuilder.CreateLandingPad(ExnTy, ConstantExpr::getBitCast(cast<Constant>(Personality), I8PtrTy), 1);
+    LP->addClause(ConstantPointerNull::get(cast<PointerType>(I8PtrTy)));
+
+    auto BeginCatchFT = FunctionType::get(I8PtrTy, I8PtrTy, false);
+    auto EndCatchFT = FunctionType::get(Type::getVoidTy(Context), false);
+    PadBuilder.CreateCall(TheModule->getOrInsertFunction("__cxa_begin_catch", BeginCatchFT),
+                          PadBuilder.CreateExtractValue(LP, 0));
+    PadBuilder.CreateCall(TheModule->getOrInsertFunction("__cxa_end_catch", EndCatchFT));
+    PadBuilder.CreateBr(blockAt(HandlerId)->LlvmBlocks.front());
+
+    LandingPads[HandlerId] = Pad;
+    return Pad;
+}
+
+// ================ GC roots table ================== //
+
+static ConstantInt* ConstInt32(size_t N) {
+    return ConstantInt::get(Type::getInt32Ty(getCodeGenContext()), N);
+}
+
+/*
+ * Returns a table of at least N values in the function frame. It is
+ * shared by every GC point of the function, and grown as needed.
+ */
+Value* GenFunction::getRootSlots(size_t N) {
+    if (!RootSlots) {
+        IRBuilder<> EntryBuilder(EntryBlock, EntryBlock->begin());
+        RootSlots = EntryBuilder.CreateAlloca(getValType(), ConstInt32(N), "GCRoots");
+    }
+    if (N > MaxRoots) {
+        MaxRoots = N;
+        RootSlots->setOperand(0, ConstInt32(N));
+    }
+    return RootSlots;
+}
+
+Value* GenFunction::getRootsBlock() {
+    if (!RootsBlock) {
+        IRBuilder<> EntryBuilder(EntryBlock, EntryBlock->begin());
+        RootsBlock = EntryBuilder.CreateAlloca(getValType(),
+            ConstInt32(sizeof(struct caml__roots_block) / sizeof(value)), "GCRootsBlock");
+    }
+    return RootsBlock;
+}
+
+/*
+ * Entry used by closures and by calls without the exact arity, with the
+ * arguments on the ZAM stack. It does the job of GRAB, moves the arguments
+ * to the native entry, and then the job of RETURN with the result.
+ */
+void GenFunction::generateZamEntry() {
+    auto Builder = Module->Builder;
+    auto& Context = getCodeGenContext();
+    auto SpVar = Module->getGlobalVariable("StackPointer");
+    auto AccuVar = Module->getGlobalVariable("Accu");
+    auto EnvVar = Module->getGlobalVariable("Env");
+
+    auto Entry = BasicBlock::Create(Context, "Entry", LlvmFunc);
+    Builder->SetInsertPoint(Entry);
+
+    // Not enough arguments, make a partial closure
+    if (Arity > 1) {
+        auto Required = ConstInt(Arity - 1);
+        auto Enough = Builder->CreateICmpNE(
+            Builder->CreateCall(Module->getFunction("checkGrab"), Required), ConstInt(0));
+        auto Partial = BasicBlock::Create(Context, "Partial", LlvmFunc);
+        auto Exact = BasicBlock::Create(Context, "Exact", LlvmFunc);
+        Builder->CreateCondBr(Enough, Exact, Partial);
+
+        Builder->SetInsertPoint(Partial);
+        Builder->CreateCall(Module->getFunction("createRestartClosure"), getClosureCode(true));
+        Builder->CreateRetVoid();
+
+        Builder->SetInsertPoint(Exact);
+        Builder->CreateCall(Module->getFunction("substractExtraArgs"), Required);
+    }
+
+    // Pop the arguments and pass them to the native entry
+    auto Sp = Builder->CreateLoad(SpVar);
+    vector<Value*> Args;
+    Args.push_back(Builder->CreateLoad(EnvVar));
+    for (int i = 0; i < Arity; i++)
+        Args.push_back(Builder->CreateLoad(Builder->CreateGEP(Sp, ConstInt(i))));
+    Builder->CreateStore(Builder->CreateGEP(Sp, ConstInt(Arity)), SpVar);
+
+    auto Result = Builder->CreateCall(NativeFunc, Args);
+    Result->setCallingConv(CallingConv::Fast);
+    Builder->CreateStore(Result, AccuVar);
+
+    // Pop the return frame, or apply the result to the extra arguments
+    auto Func = Builder->CreateCall(Module->getFunction("handleReturn"), ConstInt(0));
+    auto IntPtr = Builder->CreatePtrToInt(Func, getValType());
+    auto BoolVal = Builder->CreateICmpNE(IntPtr, ConstInt(0), "BranchRet");
+    auto BlockInvoke = BasicBlock::Create(Context, "Invoke", LlvmFunc);
+    auto BlockReturn = BasicBlock::Create(Context, "Return", LlvmFunc);
+    Builder->CreateCondBr(BoolVal, BlockInvoke, BlockReturn);
+
+    Builder->SetInsertPoint(BlockInvoke);
+    auto Call = Builder->CreateCall(Func);
+    Call->setCallingConv(CallingConv::Fast);
+    Call->setTailCall();
+    Builder->CreateRetVoid();
+
+    Builder->SetInsertPoint(BlockReturn);
+    Builder->CreateRetVoid();
+
+    verifyFunction(*LlvmFunc);
+}
+
+/*
+ * Block starting at the instruction Idx
+ */
+GenBlock* GenFunction::blockAt(int Idx) {
+    auto BlockIt = lower_bound(Blocks.begin(), Blocks.end(), Idx,
+                               [](GenBlock* Block, int Idx) { return Block->Id < Idx; });
+    if (BlockIt == Blocks.end() || (*BlockIt)->Id != Idx)
+        throw std::logic_error("No block at the instruction");
+    return *BlockIt;
+}
+
+/*
+ * Immediate dominator of every block, with the algorithm of Cooper, Harvey
+ * and Kennedy: the dominators of the predecessors are intersected in
+ * reverse postorder until nothing changes, which takes two passes when
+ * there is no irreducible loop.
+ */
+void GenFunction::computeDominators() {
+    // Depth first search from the first block, with an explicit stack of
+    // blocks and of the next successor to visit
+    vector<GenBlock*> PostOrder;
+    vector<pair<GenBlock*, size_t>> DfsStack;
+    for (auto Block : Blocks) {
+        Block->PostIndex = -1;
+        Block->Idom = nullptr;
+    }
+    FirstBlock->PostIndex = 0;
+    DfsStack.push_back(make_pair(FirstBlock, 0));
+    while (DfsStack.size()) {
+        auto Block = DfsStack.back().first;
+        auto Next = DfsStack.back().second++;
+        if (Next < Block->NextBlocks.size()) {
+            auto NextBlock = Block->NextBlocks[Next];
+            if (NextBlock->PostIndex < 0) {
+                NextBlock->PostIndex = 0;
+                DfsStack.push_back(make_pair(NextBlock, 0));
+            }
+        } else {
+            Block->PostIndex = PostOrder.size();
+            PostOrder.push_back(Block);
+            DfsStack.pop_back();
+        }
+    }
+
+    // Common dominator, found by walking up the tree from both blocks
+    auto intersect = [](GenBlock* Block1, GenBlock* Block2) {
+        while (Block1 != Block2) {
+            while (Block1->PostIndex < Block2->PostIndex) Block1 = Block1->Idom;
+            while (Block2->PostIndex < Block1->PostIndex) Block2 = Block2->Idom;
+        }
+        return Block1;
+    };
+
+    FirstBlock->Idom = FirstBlock;
+    bool Changed = true;
+    while (Changed) {
+        Changed = false;
+        for (auto BlockIt = PostOrder.rbegin(); BlockIt != PostOrder.rend(); BlockIt++) {
+            auto Block = *BlockIt;
+            if (Block == FirstBlock) continue;
+
+            GenBlock* Idom = nullptr;
+            for (auto PrevBlock : Block->PreviousBlocks) {
+                if (!PrevBlock->Idom) continue;
+                Idom = Idom ? intersect(PrevBlock, Idom) : PrevBlock;
+            }
+            if (Idom != Block->Idom) {
+                Block->Idom = Idom;
+                Changed = true;
+            }
+        }
+    }
+    FirstBlock->Idom = nullptr;
+}
+
 /*
- * Remove blocks which are not the first block
- * And have no predecessors.
- * IE : Dead code blocks
+ * Natural loops. A jump to a block dominating its source is a back edge,
+ * and the loop of the target is made of the blocks reaching one of its
+ * back edges without going through it. Headers are visited in reverse
+ * postorder, so outer loops are marked before the loops they contain.
+ * Needs the dominators.
  */
-void GenFunction::removeUnusedBlocks() {
-    int i = 0;
-    list<int> ToRemoveBlocks;
-    bool restart = false;
-    for (auto BlockP : Blocks) {
-        if (i > 0 && BlockP.second->PreviousBlocks.size() == 0) {
-            ToRemoveBlocks.push_front(BlockP.first);
+void GenFunction::computeLoops() {
+    LoopHeaders.clear();
+    for (auto Block : Blocks) {
+        Block->LoopHeader = nullptr;
+        Block->LoopDepth = 0;
+    }
+
+    vector<GenBlock*> Headers(Blocks.size(), nullptr);
+    for (auto Block : Blocks)
+        if (Block->PostIndex >= 0)
+            Headers[Blocks.size() - 1 - Block->PostIndex] = Block;
+
+    // Last header each block was added to the loop of
+    vector<GenBlock*> Marks(Blocks.size(), nullptr);
+    vector<GenBlock*> Worklist;
+    for (auto Header : Headers) {
+        if (!Header) continue;
+        for (auto PrevBlock : Header->PreviousBlocks)
+            if (Header->dominates(PrevBlock) && Marks[PrevBlock->Index] != Header) {
+                Marks[PrevBlock->Index] = Header;
+                Worklist.push_back(PrevBlock);
+            }
+        if (Worklist.empty()) continue;
+
+        LoopHeaders.push_back(Header);
+        Marks[Header->Index] = Header;
+        Header->LoopHeader = Header;
+        Header->LoopDepth++;
+        while (Worklist.size()) {
+            auto Block = Worklist.back();
+            Worklist.pop_back();
+            if (Block == Header) continue;
+            Block->LoopHeader = Header;
+            Block->LoopDepth++;
+            for (auto PrevBlock : Block->PreviousBlocks)
+                if (Marks[PrevBlock->Index] != Header) {
+                    Marks[PrevBlock->Index] = Header;
+                    Worklist.push_back(PrevBlock);
+                }
         }
-        i++;
     }
-    for (auto BlockNum : ToRemoveBlocks) {
-        auto Block = Blocks[BlockNum];
-        for (auto NBlock : Block->NextBlocks) {
-            NBlock->PreviousBlocks.remove(Block);
-            if (NBlock->PreviousBlocks.size() == 0) restart = true;
+}
+
+// ================ VM registers promotion ================== //
+
+/*
+ * StdLib helpers work on the VM registers (Accu, Env, StackPointer and
+ * extra_args), which are globals of the StdLib module. Once the helpers
+ * are inlined, every access to those globals is done in the function
+ * body, and they can be replaced by accesses to function locals.
+ * The globals are only read and written around remaining calls: C
+ * primitives, the GC, setjmp for exception handlers, and other OCaml
+ * functions, which all expect the VM state to be in memory.
+ */
+
+static const char* VMRegisters[] = {"Accu", "Env", "StackPointer", "extra_args"};
+
+void GenFunction::inlineHelpers(Function* F) {
+    bool Inlined = true;
+    while (Inlined) {
+        Inlined = false;
+        vector<CallInst*> Calls;
+        for (auto& BB : *F) {
+            for (auto& I : BB) {
+                auto Call = dyn_cast<CallInst>(&I);
+                if (!Call) continue;
+                auto Callee = Call->getCalledFunction();
+                // Calls of the code that never ran in the profiled run
+                if (Call->getMetadata("z3.cold")) continue;
+                if (Callee && Module->isInlinableHelper(Callee)) {
+                    Callee->Materialize();
+                    Calls.push_back(Call);
+                }
+            }
+        }
+        for (auto Call : Calls) {
+            InlineFunctionInfo IFI;
+            Inlined |= InlineFunction(Call, IFI);
         }
-        Blocks.erase(BlockNum);
     }
-    if (restart) removeUnusedBlocks();
+}
+
+/*
+ * Inlines the helpers and runs the function passes on the generated code
+ */
+void GenFunction::optimize() {
+    inlineHelpers(LlvmFunc);
+    Module->FPM->run(*LlvmFunc);
+    if (Native) {
+        inlineHelpers(NativeFunc);
+        Module->FPM->run(*NativeFunc);
+    }
+}
+
+void GenFunction::promoteRegisters() {
+    promoteRegisters(LlvmFunc);
+    if (Native) promoteRegisters(NativeFunc);
+}
+
+void GenFunction::promoteRegisters(Function* F) {
+    inlineHelpers(F);
+
+    map<Value*, AllocaInst*> Locals;
+    vector<AllocaInst*> Allocas;
+    auto& Entry = F->getEntryBlock();
+    IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+
+    for (auto Name : VMRegisters) {
+        auto Global = Module->getGlobalVariable(Name);
+        auto Local = EntryBuilder.CreateAlloca(Global->getType()->getElementType(), 0, Name);
+        Locals[Global] = Local;
+        Allocas.push_back(Local);
+    }
+
+    // Redirect register accesses to the locals, and collect the points
+    // where the globals have to be up to date
+    vector<Instruction*> SyncPoints;
+    for (auto& BB : *F) {
+        for (auto& I : BB) {
+            if (auto Load = dyn_cast<LoadInst>(&I)) {
+                auto Local = Locals.find(Load->getPointerOperand());
+                if (Local != Locals.end()) Load->setOperand(0, Local->second);
+            } else if (auto Store = dyn_cast<StoreInst>(&I)) {
+                auto Local = Locals.find(Store->getPointerOperand());
+                if (Local != Locals.end()) Store->setOperand(1, Local->second);
+            } else if ((isa<CallInst>(&I) && !isa<IntrinsicInst>(&I)) || isa<InvokeInst>(&I)) {
+                SyncPoints.push_back(&I);
+            } else if (isa<ReturnInst>(&I)) {
+                SyncPoints.push_back(&I);
+            }
+        }
+    }
+
+    auto storeGlobals = [&](IRBuilder<>& B) {
+        for (auto LocalP : Locals)
+            B.CreateStore(B.CreateLoad(LocalP.second), LocalP.first);
+    };
+    auto loadGlobals = [&](IRBuilder<>& B) {
+        for (auto LocalP : Locals)
+            B.CreateStore(B.CreateLoad(LocalP.first), LocalP.second);
+    };
+
+    // Initialize the locals at function entry
+    loadGlobals(EntryBuilder);
+
+    set<BasicBlock*> LoadedBlocks;
+    for (auto I : SyncPoints) {
+        BasicBlock::iterator Next = I;
+        Next++;
+
+        if (auto Invoke = dyn_cast<InvokeInst>(I)) {
+            // The globals are read at the start of both successors,
+            // landing pads being shared by several invokes
+            IRBuilder<> Before(I);
+            storeGlobals(Before);
+            BasicBlock* Succs[] = { Invoke->getNormalDest(), Invoke->getUnwindDest() };
+            for (auto Succ : Succs) {
+                if (!LoadedBlocks.insert(Succ).second) continue;
+                BasicBlock::iterator It = Succ->getFirstNonPHI();
+                if (isa<LandingPadInst>(It)) It++;
+                IRBuilder<> After(Succ, It);
+                loadGlobals(After);
+            }
+        } else if (isa<ReturnInst>(I)) {
+            // Already synchronized by the call in tail position
+            if (I != &I->getParent()->front()) {
+                BasicBlock::iterator Prev = I;
+                Prev--;
+                if (isa<CallInst>(Prev) && !isa<IntrinsicInst>(Prev)) continue;
+            }
+            IRBuilder<> B(I);
+            storeGlobals(B);
+        } else {
+            IRBuilder<> Before(I);
+            storeGlobals(Before);
+            // Keep tail calls in tail position, the caller reads the globals
+            if (isa<ReturnInst>(Next)) continue;
+            IRBuilder<> After(Next->getParent(), Next);
+            loadGlobals(After);
+        }
+    }
+
+    DominatorTree DT;
+    DT.runOnFunction(*F);
+    PromoteMemToReg(Allocas, DT);
+
+    verifyFunction(*F);
 }
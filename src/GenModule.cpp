@@ -1,63 +1,150 @@
 #include <CodeGen.hpp>
 #include <Utils.hpp>
+#include <JitEngine.hpp>
+#include <Timing.hpp>
 
-#include "llvm/Support/IRReader.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Analysis/Passes.h"
 #include "llvm/Transforms/IPO.h"
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/Target/TargetOptions.h"
 #include "llvm/Target/TargetData.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/LLVMContext.h"
+#include "llvm/GVMaterializer.h"
 
 using namespace std;
 using namespace llvm;
 
-// ================ GenModule Implementation ================== //
+// StdLib bitcode, see StdLibBitcode.S
+extern "C" const char StdLibBitcode[], StdLibBitcodeEnd[];
 
-void setAlwaysInline(Function& Func) {
-    llvm::Attributes Attrs;
-    Attrs |= Attribute::AlwaysInline;
-    Func.addFnAttr(Attrs);
-}
+// ================ Lazy code generation ================== //
 
-GenModule::GenModule() {
+/*
+ * Functions are declared when they are referenced, and their code is
+ * generated when the JIT needs it. Calls to a function that was not
+ * compiled yet go through a lazy stub of the JIT, which asks for its
+ * code on the first call and is then patched to jump to it. Only the
+ * functions that actually run are lowered, optimized and emitted.
+ * StdLib helpers are copied from the bitcode the same way.
+ */
+class FunctionMaterializer : public GVMaterializer {
+    GenModule* Mod;
 
-    InitializeNativeTarget();
-    SMDiagnostic Diag;
-    auto StdLibPath = getExecutablePath();
-    StdLibPath.append("StdLib.ll");
-    TheModule = ParseIRFile(StdLibPath, Diag, getGlobalContext()); //new Module("testmodule", getGlobalContext());
-    for (Function& Func : TheModule->getFunctionList()) {
-        if (Func.getName() == "makeClosure") {
-            setAlwaysInline(Func);
-        }
+    GenFunction* getGenFunction(const GlobalValue* GV) const {
+        auto FuncP = Mod->GenFunctions.find(dyn_cast<Function>(GV));
+        return FuncP == Mod->GenFunctions.end() ? nullptr : FuncP->second;
+    }
+
+public:
+    FunctionMaterializer(GenModule* Mod) : Mod(Mod) {}
+
+    bool isMaterializable(const GlobalValue* GV) const {
+        auto Func = getGenFunction(GV);
+        return (Func && !Func->Generated) || Mod->isStdLibDecl(GV);
+    }
+
+    bool isDematerializable(const GlobalValue* GV) const {
+        return false;
     }
-    Builder = new IRBuilder<>(getGlobalContext());
-    TargetOptions TargOps;
-    TargOps.GuaranteedTailCallOpt = 1;
+
+    bool Materialize(GlobalValue* GV, string* ErrInfo = 0) {
+        // Functions emitted before are done
+        if (Mod->ExecEngine)
+            Mod->ExecEngine->freeEmittedIR();
+        if (Mod->isStdLibDecl(GV))
+            Mod->materializeHelper(cast<Function>(GV));
+        else if (isMaterializable(GV))
+            Mod->compileFunction(getGenFunction(GV));
+        // The JIT emits the function next
+        if (Mod->ExecEngine)
+            Mod->ExecEngine->startEmission();
+        return false;
+    }
+
+    bool MaterializeModule(Module* M, string* ErrInfo = 0) {
+        for (auto FuncP : Mod->Functions)
+            if (!FuncP.second->Generated)
+                Mod->compileFunction(FuncP.second);
+        // Helpers import the ones they call
+        while (Mod->StdLibDecls.size())
+            Mod->materializeHelper(Mod->StdLibDecls.begin()->first);
+        return false;
+    }
+};
+
+// ================ GenModule Implementation ================== //
+
+GenModule::GenModule(bool Jit) {
+
+    auto Start = Timing::Clock::now();
     string ErrStr;
-    ExecEngine = EngineBuilder(TheModule).setErrorStr(&ErrStr)
-                                         .setTargetOptions(TargOps)
-                                         .create();
-    if (!ExecEngine) {
-        cerr << "Could not create ExecutionEngine: " << ErrStr << endl;
+    auto Buffer = MemoryBuffer::getMemBuffer(StringRef(StdLibBitcode, StdLibBitcodeEnd - StdLibBitcode),
+                                             "StdLib.bc", false);
+    StdLibModule = getLazyBitcodeModule(Buffer, getCodeGenContext(), &ErrStr);
+    if (!StdLibModule) {
+        cerr << "Could not read StdLib: " << ErrStr << endl;
         exit(1);
     }
+    Timing::add("StdLib loading", Start);
+    Timing::count("StdLib functions", StdLibModule->size());
+    TheModule = new Module("Z3", getCodeGenContext());
+    TheModule->setDataLayout(StdLibModule->getDataLayout());
+    TheModule->setTargetTriple(StdLibModule->getTargetTriple());
+    TheModule->setMaterializer(new FunctionMaterializer(this));
 
-    PM = new PassManager();
-    PM->add(createFunctionInliningPass());
-    PM->add(createAlwaysInlinerPass());
+    Builder = new IRBuilder<>(getCodeGenContext());
+    Locals = false;
+    Mixed = false;
+    ProfileGen = nullptr;
+    ProfileUse = nullptr;
+    ExecEngine = Jit ? new JitEngine(this) : nullptr;
+    FPM = nullptr;
+    setOptLevel(0);
+}
 
+/*
+ * Sets the passes run on the generated functions. Level 1 runs the passes
+ * -o always ran. Finer levels were not kept: their pipelines could not be
+ * backed by measurements, test/optbenches.sh compares the two levels.
+ */
+void GenModule::setOptLevel(int Level) {
+    OptLevel = Level;
+    delete FPM;
     FPM = new FunctionPassManager(TheModule);
-    FPM->add(new TargetData(*ExecEngine->getTargetData()));
+    if (ExecEngine)
+        FPM->add(new TargetData(*ExecEngine->getTargetData()));
+    else
+        FPM->add(new TargetData(TheModule));
+    if (Level == 0) return;
+
     FPM->add(createBasicAliasAnalysisPass());
     FPM->add(createInstructionCombiningPass());
     FPM->add(createReassociatePass());
     FPM->add(createGVNPass());
     FPM->add(createCFGSimplificationPass());
     FPM->add(createSCCPPass());
+}
 
+/*
+ * Generates the code of Func, and runs the enabled passes on it
+ */
+void GenModule::compileFunction(GenFunction* Func) {
+    auto Start = Timing::Clock::now();
+    Func->CodeGen();
+    Timing::add("IR generation", Start);
+    Timing::addFunction(Func->name(), Start);
+    Timing::count("generated functions", 1);
+
+    if (Locals) {
+        Timing::Phase T("register promotion");
+        Func->promoteRegisters();
+    }
+    if (OptLevel) {
+        Timing::Phase T("optimization");
+        Func->optimize();
+    }
 }
 
 void GenModule::Print() {
@@ -77,8 +164,156 @@ void GenModule::Print() {
     cout << "}\n";
 }
 
+// ================ StdLib import ================== //
+
+static bool hasBody(const Function* Func) {
+    return Func->isMaterializable() || !Func->isDeclaration();
+}
+
+/*
+ * Returns the copy of a StdLib global in TheModule, creating it if needed.
+ * Functions are first declared, global variables are copied with their
+ * initializer.
+ */
+Constant* GenModule::importValue(GlobalValue* StdLibValue) {
+    auto ValueP = StdLibValues.find(StdLibValue);
+    if (ValueP != StdLibValues.end()) {
+        Value* Imported = ValueP->second;
+        return cast<Constant>(Imported);
+    }
+
+    // Declared by the generated code, or by a linked module
+    if (auto Existing = TheModule->getNamedValue(StdLibValue->getName())) {
+        if (Existing->getType() != StdLibValue->getType()) {
+            auto Cast = ConstantExpr::getBitCast(Existing, StdLibValue->getType());
+            StdLibValues[StdLibValue] = Cast;
+            return Cast;
+        }
+        auto ExistingFunc = dyn_cast<Function>(Existing);
+        auto Func = dyn_cast<Function>(StdLibValue);
+        if (ExistingFunc && ExistingFunc->isDeclaration() && hasBody(Func)) {
+            StdLibDecls[ExistingFunc] = Func;
+            StdLibFunctions.insert(ExistingFunc);
+        }
+        StdLibValues[StdLibValue] = Existing;
+        return Existing;
+    }
+
+    if (auto Func = dyn_cast<Function>(StdLibValue)) {
+        auto NewFunc = Function::Create(Func->getFunctionType(), GlobalValue::ExternalLinkage,
+                                        Func->getName(), TheModule);
+        NewFunc->copyAttributesFrom(Func);
+        StdLibValues[Func] = NewFunc;
+        if (hasBody(Func)) {
+            StdLibDecls[NewFunc] = Func;
+            StdLibFunctions.insert(NewFunc);
+        }
+        return NewFunc;
+    }
+
+    auto Global = cast<GlobalVariable>(StdLibValue);
+    auto NewGlobal = new GlobalVariable(*TheModule, Global->getType()->getElementType(),
+                                        Global->isConstant(), Global->getLinkage(), nullptr,
+                                        Global->getName());
+    NewGlobal->copyAttributesFrom(Global);
+    StdLibValues[Global] = NewGlobal;
+    if (Global->hasInitializer()) {
+        importOperands(Global->getInitializer());
+        NewGlobal->setInitializer(cast<Constant>(MapValue(Global->getInitializer(), StdLibValues)));
+    }
+    return NewGlobal;
+}
+
+/*
+ * Imports the globals used by the operands of Val, so that it can be
+ * mapped to TheModule
+ */
+void GenModule::importOperands(User* Val) {
+    for (auto& Op : Val->operands()) {
+        if (auto Global = dyn_cast<GlobalValue>(Op))
+            importValue(Global);
+        else if (isa<Constant>(Op))
+            importOperands(cast<Constant>(Op));
+    }
+}
+
+bool GenModule::isStdLibDecl(const GlobalValue* GV) {
+    auto Func = dyn_cast<Function>(const_cast<GlobalValue*>(GV));
+    return Func && StdLibDecls.count(Func);
+}
+
+/*
+ * Copies the body of an imported StdLib function, reading it from the
+ * bitcode first
+ */
+void GenModule::materializeHelper(Function* Func) {
+    auto StdLibFunc = StdLibDecls[Func];
+    StdLibDecls.erase(Func);
+
+    string ErrStr;
+    if (StdLibFunc->Materialize(&ErrStr)) {
+        cerr << "Could not read " << StdLibFunc->getName().str() << " from StdLib: " << ErrStr << endl;
+        exit(1);
+    }
+    for (auto& BB : *StdLibFunc)
+        for (auto& Inst : BB)
+            importOperands(&Inst);
+
+    auto Arg = Func->arg_begin();
+    for (auto& StdLibArg : StdLibFunc->getArgumentList()) {
+        Arg->setName(StdLibArg.getName());
+        StdLibValues[&StdLibArg] = Arg++;
+    }
+    SmallVector<ReturnInst*, 8> Returns;
+    CloneFunctionInto(Func, StdLibFunc, StdLibValues, true, Returns);
+    Func->setLinkage(StdLibFunc->getLinkage());
+    Timing::count("imported StdLib functions", 1);
+}
+
+/*
+ * Maps the StdLib declarations that modules linked in TheModule added
+ */
+void GenModule::resolveStdLib() {
+    for (Function& Func : *TheModule) {
+        if (!Func.isDeclaration() || StdLibDecls.count(&Func)) continue;
+        auto StdLibFunc = StdLibModule->getFunction(Func.getName());
+        if (StdLibFunc && !StdLibValues.count(StdLibFunc))
+            importValue(StdLibFunc);
+    }
+    for (GlobalVariable& Global : TheModule->getGlobalList()) {
+        if (!Global.isDeclaration()) continue;
+        auto StdLibGlobal = StdLibModule->getGlobalVariable(Global.getName());
+        if (!StdLibGlobal || !StdLibGlobal->hasInitializer()) continue;
+        StdLibValues[StdLibGlobal] = &Global;
+        importOperands(StdLibGlobal->getInitializer());
+        Global.setInitializer(cast<Constant>(MapValue(StdLibGlobal->getInitializer(), StdLibValues)));
+        Global.setLinkage(StdLibGlobal->getLinkage());
+    }
+}
+
 Function* GenModule::getFunction(string Name) {
-  auto F = TheModule->getFunction(Name);
-  return F;
+    auto Func = StdLibModule->getFunction(Name);
+    if (!Func) return TheModule->getFunction(Name);
+    return dyn_cast<Function>(importValue(Func));
 }
 
+GlobalVariable* GenModule::getGlobalVariable(string Name) {
+    auto Global = StdLibModule->getGlobalVariable(Name);
+    if (!Global) return TheModule->getGlobalVariable(Name);
+    return dyn_cast<GlobalVariable>(importValue(Global));
+}
+
+
+/*
+ * Helpers that can be inlined in generated functions.
+ * Helpers that raise, or that are only used for debugging
+ * are kept as calls.
+ */
+bool GenModule::isInlinableHelper(Function* Func) {
+    static set<string> NotInlinable = {
+        "throwException", "raiseFromC",
+        "addCall", "endCall", "printCallChain", "debug", "cmpDebug", "printAccu"
+    };
+    return StdLibFunctions.count(Func)
+        && !NotInlinable.count(Func->getName().str());
+}
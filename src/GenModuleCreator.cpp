@@ -1,167 +1,311 @@
 #include <CodeGen.hpp>
+#include <BytecodeOptimizer.hpp>
+#include <Reachability.hpp>
+#include <algorithm>
 #include <stdexcept>
 
 using namespace std;
 using namespace llvm;
 
-deque<ZInstruction*>* removeDeadInstructions(deque<ZInstruction*>* Instructions) {
-    auto NewInsts = new deque<ZInstruction*>();
-    int32_t MaxBranch = 0;
-    int32_t SmallestCondBranch = 0;
-    while (Instructions->size()) {
-        auto Inst = Instructions->front();
-        Instructions->pop_front();
-        if (Inst->idx >= MaxBranch || (Inst->idx >= SmallestCondBranch && SmallestCondBranch > 0)) {
-            NewInsts->push_back(Inst);
-            if ((Inst->isCondJump() || Inst->isPushTrap()) && 
-                    (SmallestCondBranch > Inst->getDestIdx() || 
-                     SmallestCondBranch == 0)) {
-                SmallestCondBranch = Inst->getDestIdx();
-            }
-            if (Inst->OpNum == BRANCH) {
-                MaxBranch = Inst->Args[0];
-            }
-        }
-    }
-    return NewInsts;
-}
-
 // ================ GenModuleCreator Implementation ================== //
 
+/*
+ * A function is made of the instructions reachable from its entry, the
+ * target of a CLOSURE or CLOSUREREC, without going through the entry of
+ * another function. The main function is made of the ones reachable from
+ * the first instruction. Every instruction is visited once, and dead code
+ * is part of no function. Functions that can never be called are dropped,
+ * and their closures are replaced by unit.
+ */
 GenModule* GenModuleCreator::generate(int FirstInst, int LastInst) {
 
-    deque<ZInstruction*> QInstructions;
-    deque<ZInstruction*> MainBlockInsts;
-
     // If last inst is negative, it will trim the last X instructions
     if (LastInst == 0) LastInst = OriginalInstructions->size() - 1;
     else if (LastInst < 0) LastInst = OriginalInstructions->size() + LastInst;
-
-    // Create a queue of all instructions
+    this->FirstInst = FirstInst;
+    this->LastInst = LastInst;
+
+    // Instruction indexes are the positions, unless some instructions
+    // were erased for debugging
+    int32_t MaxIdx = 0;
+    for (int i = FirstInst; i <= LastInst; i++)
+        MaxIdx = max(MaxIdx, OriginalInstructions->at(i)->idx);
+    Positions.assign(MaxIdx + 1, -1);
+    for (int i = FirstInst; i <= LastInst; i++)
+        Positions[OriginalInstructions->at(i)->idx] = i;
+
+    Owners.assign(OriginalInstructions->size(), -1);
+    Leaders.assign(OriginalInstructions->size(), false);
+    BlockStarts.assign(OriginalInstructions->size(), nullptr);
+
+    // Function entries are the targets of CLOSURE and CLOSUREREC
+    vector<bool> IsEntry(OriginalInstructions->size(), false);
     for (int i = FirstInst; i <= LastInst; i++) {
-        QInstructions.push_back(OriginalInstructions->at(i));
+        ZInstruction* Inst = OriginalInstructions->at(i);
+        if (Inst->isClosure() && positionOf(Inst->getDestIdx()) >= 0)
+            IsEntry[positionOf(Inst->getDestIdx())] = true;
+        if (Inst->isClosureRec())
+            for (auto Fn : Inst->closureRecFns())
+                if (positionOf(Fn) >= 0) IsEntry[positionOf(Fn)] = true;
     }
 
-    // Create functions. This will also remove the function's instructions
-    // from the queue, so that only the remaining instructions are added 
-    // to MainBlockInsts
-    while (QInstructions.size()) {
-        ZInstruction* Inst = QInstructions[0];
-        if (Inst->Annotation == FUNCTION_START) {
-            auto FuncInsts = initFunction(&QInstructions);
-            generateFunction(Module->Functions[Inst->idx], FuncInsts);
-        } else {
-            if (Inst->OpNum != RESTART) {
-                MainBlockInsts.push_back(Inst);
-            }
-            QInstructions.pop_front();
-        }
+    // The main function is the first one. Entries are owned first, so
+    // that no function goes through the entry of another one.
+    vector<int> Entries(1, FirstInst);
+    Owners[FirstInst] = 0;
+    for (int i = FirstInst; i <= LastInst; i++) {
+        if (!IsEntry[i]) continue;
+        Owners[i] = Entries.size();
+        Entries.push_back(i);
     }
 
-    // Create the main function, based on the remaining instructions
-    Module->MainFunction = new GenFunction(MAIN_FUNCTION_ID, Module);
-    Module->MainFunction->Arity = 0;
-    generateFunction(Module->MainFunction, removeDeadInstructions(&MainBlockInsts));
-    Module->MainFunction->removeUnusedBlocks();
-
-    return Module;
-}
+    for (size_t i = 0; i < Entries.size(); i++)
+        markFunction(Entries[i]);
 
-deque<ZInstruction*>* GenModuleCreator::initFunction(deque<ZInstruction*>* Instructions) {
+    // Instructions of each function, in bytecode order
+    vector<vector<int32_t>> FuncPositions(Entries.size());
+    for (int i = FirstInst; i <= LastInst; i++)
+        if (Owners[i] >= 0)
+            FuncPositions[Owners[i]].push_back(i);
 
-    auto FuncInsts = new deque<ZInstruction*>();
-    int MaxInstIdx = 0;
+    // Functions that can never be called are not generated
+    ReachabilityAnalysis Reachability(*OriginalInstructions, Positions, Owners);
+    LiveFunctions = Reachability.run(FuncPositions);
+    DeadFunctions = count(LiveFunctions.begin(), LiveFunctions.end(), false);
 
-    // Create the Function and add it to the module functions
-    int InstIdx = Instructions->at(0)->idx;
-    GenFunction* Func = new GenFunction(InstIdx, this->Module);
-    this->Module->Functions[InstIdx] = Func;
+    Module->MainFunction = new GenFunction(MAIN_FUNCTION_ID, Module);
+    Module->MainFunction->Arity = 0;
+    generateFunction(Module->MainFunction, FirstInst, FuncPositions[0]);
+
+    for (size_t i = 1; i < Entries.size(); i++) {
+        if (!LiveFunctions[i]) continue;
+        ZInstruction* Inst = OriginalInstructions->at(Entries[i]);
+        auto Func = new GenFunction(Inst->idx, Module);
+        Module->Functions[Inst->idx] = Func;
+        Func->Arity = Inst->OpNum == GRAB ? Inst->Args[0] + 1 : 1;
+        generateFunction(Func, Entries[i], FuncPositions[i]);
+    }
 
-    ZInstruction* FirstInst = Instructions->at(0);
-    if (FirstInst->OpNum == GRAB) {
-        Func->Arity = FirstInst->Args[0] + 1;
-    } else {
-        Func->Arity = 1;
+    // Give each function of a recursive group the ids of the whole group,
+    // so that its OFFSETCLOSURE instructions can be resolved
+    for (int i = FirstInst; i <= LastInst; i++) {
+        ZInstruction* Inst = OriginalInstructions->at(i);
+        if (!Inst->isClosureRec()) continue;
+
+        auto Fns = Inst->closureRecFns();
+        std::vector<int> Group(Fns.begin(), Fns.end());
+        if (!Module->Functions.count(Group[0])) continue;
+        for (int j = 0; j < Inst->Args[0]; j++) {
+            auto Func = Module->Functions[Group[j]];
+            Func->RecGroup = Group;
+            Func->RecIndex = j;
+        }
     }
 
-    ZInstruction* Inst;
-    while (true) {
-        Inst = Instructions->at(0);
-        Instructions->pop_front();
-        FuncInsts->push_back(Inst);
+    Positions.clear();
+    Owners.clear();
+    Leaders.clear();
+    BlockStarts.clear();
+    LiveFunctions.clear();
+    return Module;
+}
 
-        // Keep track of the labeled instruction with the max idx
-        // that is part of the function
-        if (Inst->isJumpInst() || Inst->OpNum == PUSHTRAP) 
-            MaxInstIdx = max(MaxInstIdx, Inst->getDestIdx());
+/*
+ * Position of the instruction Idx, or -1 if it is not generated
+ */
+int GenModuleCreator::positionOf(int32_t Idx) {
+    if (Idx < 0 || Idx >= (int32_t)Positions.size()) return -1;
+    return Positions[Idx];
+}
 
-        if (Inst->isSwitch()) {
-            MaxInstIdx = max(MaxInstIdx, Inst->SwitchEntries.back());
-        }
+/*
+ * True if the instruction never continues to the next one
+ */
+static bool endsBlock(ZInstruction* Inst) {
+    return Inst->isUncondJump() || Inst->isReturn() || Inst->isSwitch();
+}
 
-        // If the instruction is a return instruction
-        // And there is no jump to an instruction after this one
-        // We have reached the end of the function
-        if (Inst->isReturn() && Inst->idx >= MaxInstIdx) {
-            return FuncInsts;
-        }
+/*
+ * Gives to the owner of the entry at position Entry the instructions
+ * reachable from it: the next instruction, jump targets, switch cases and
+ * exception handlers
+ */
+void GenModuleCreator::markFunction(int Entry) {
+    vector<int> Worklist(1, Entry);
+    int Owner = Owners[Entry];
+
+    auto visit = [&](int Pos) {
+        if (Pos < FirstInst || Pos > LastInst || Owners[Pos] >= 0) return;
+        Owners[Pos] = Owner;
+        Worklist.push_back(Pos);
+    };
+
+    while (Worklist.size()) {
+        int Pos = Worklist.back();
+        Worklist.pop_back();
+        ZInstruction* Inst = OriginalInstructions->at(Pos);
+
+        if (!endsBlock(Inst)) visit(Pos + 1);
+        if (Inst->isJumpInst() || Inst->isPushTrap())
+            visit(positionOf(Inst->getDestIdx()));
+        if (Inst->isSwitch())
+            for (auto Dest : Inst->switchEntries())
+                visit(positionOf(Dest));
     }
-
 }
 
-void GenModuleCreator::generateFunction(GenFunction* Function, deque<ZInstruction*>* Instructions) {
+/*
+ * Splits the instructions of the function in blocks, at its entry, at
+ * jump targets and after the instructions ending a block. The blocks are
+ * simplified by BytecodeOptimizer before being linked, and the ones that
+ * became unreachable are removed. Blocks are in bytecode order.
+ */
+void GenModuleCreator::generateFunction(GenFunction* Function, int Entry,
+                                        const vector<int32_t>& FuncPositions) {
+
+    // Targets outside of the generated range are ignored
+    auto markLeader = [&](int32_t Idx) {
+        int Pos = positionOf(Idx);
+        if (Pos >= 0) Leaders[Pos] = true;
+    };
+    auto blockAt = [&](int32_t Idx) {
+        int Pos = positionOf(Idx);
+        return Pos >= 0 ? BlockStarts[Pos] : nullptr;
+    };
+
+    Leaders[Entry] = true;
+    int PrevPos = -1;
+    for (auto Pos : FuncPositions) {
+        ZInstruction* Inst = OriginalInstructions->at(Pos);
+        if (PrevPos < 0 || PrevPos + 1 != Pos || endsBlock(OriginalInstructions->at(PrevPos)))
+            Leaders[Pos] = true;
+        if (Inst->isJumpInst() || Inst->isPushTrap())
+            markLeader(Inst->getDestIdx());
+        if (Inst->isCondJump() && Pos < LastInst)
+            Leaders[Pos + 1] = true;
+        if (Inst->isSwitch())
+            for (auto Dest : Inst->switchEntries())
+                markLeader(Dest);
+        PrevPos = Pos;
+    }
 
-    // The first instruction is the beginning of a block
-    Instructions->at(0)->Annotation = BLOCK_START;
+    for (auto Pos : FuncPositions) {
+        if (!Leaders[Pos]) continue;
+        auto Block = new GenBlock(OriginalInstructions->at(Pos)->idx, Function);
+        Function->Blocks.push_back(Block);
+        BlockStarts[Pos] = Block;
+    }
+    Function->FirstBlock = BlockStarts[Entry];
+    Function->CodeOffset = OriginalInstructions->at(Entry)->OrigIdx;
 
-    // Make a block for every instruction that is a BLOCK_START
-    // This is necessary so we can reference next and previous blocks
-    for (ZInstruction* Inst: *Instructions) {
-        if (Inst->Annotation == BLOCK_START) {
-            auto Block = new GenBlock(Inst->idx, Function);
-            Function->Blocks[Inst->idx] = Block;
-        }
+    // Position of the last instruction of each block
+    vector<int> BlockEnds(Function->Blocks.size());
+    GenBlock* CBlock = nullptr;
+    for (auto Pos : FuncPositions) {
+        ZInstruction* Inst = OriginalInstructions->at(Pos);
+        if (BlockStarts[Pos]) CBlock = BlockStarts[Pos];
+        if (isDeadClosure(Inst)) addDeadClosure(Function, Inst, CBlock->Instructions);
+        else CBlock->Instructions.push_back(Inst);
+        BlockEnds[CBlock->Index] = Pos;
     }
 
-    // Get the first block
-    Function->FirstBlock = Function->Blocks[Instructions->at(0)->idx];
+    BytecodeOptimizer Optimizer(Function->Rewritten);
+    for (auto Block : Function->Blocks)
+        Optimizer.run(Block->Instructions);
 
-    GenBlock* CBlock = nullptr;
-    while (Instructions->size()) {
-
-        // Get the first remaining instruction
-        ZInstruction* Inst = Instructions->at(0);
-        Instructions->pop_front();
-
-        if (Inst->Annotation == BLOCK_START) {
-
-            // Make the block connections if necessary
-            if (CBlock) {
-                ZInstruction* LastInst = CBlock->Instructions.back();
-                if (!(LastInst->isUncondJump() 
-                      || LastInst->isReturn()
-                      || LastInst->isSwitch())) {
-                    CBlock->setNext(Function->Blocks[Inst->idx], false);
-                }
+    for (auto Block : Function->Blocks) {
+        for (auto Inst : Block->Instructions) {
+            if (Inst->isJumpInst() || Inst->isPushTrap()) {
+                auto Dest = blockAt(Inst->getDestIdx());
+                if (Dest) Block->setNext(Dest, true);
+                if (Dest && Inst->isPushTrap()) Dest->IsTrapHandler = true;
             }
 
-            // Set the current block
-            CBlock = Function->Blocks[Inst->idx];
+            // The first case is also the default of the llvm switch,
+            // which is one more edge to it
+            if (Inst->isSwitch()) {
+                auto Entries = Inst->switchEntries();
+                if (blockAt(Entries[0])) Block->setNext(blockAt(Entries[0]), false);
+                for (auto Case : Entries)
+                    if (blockAt(Case)) Block->setNext(blockAt(Case), false);
+            }
         }
 
-        CBlock->Instructions.push_back(Inst);
+        // Fall through to the next block
+        int Next = BlockEnds[Block->Index] + 1;
+        if (!endsBlock(Block->Instructions.back()) && Next <= LastInst
+            && Owners[Next] == Owners[Entry])
+            Block->setNext(BlockStarts[Next], false);
+    }
+
+    removeUnreachableBlocks(Function);
+    Function->computeDominators();
+    Function->computeLoops();
+}
+
+/*
+ * True for the CLOSURE and CLOSUREREC creating functions that are not
+ * generated
+ */
+bool GenModuleCreator::isDeadClosure(ZInstruction* Inst) {
+    int Pos = -1;
+    if (Inst->isClosure()) Pos = positionOf(Inst->getDestIdx());
+    else if (Inst->isClosureRec()) Pos = positionOf(Inst->closureRecFns()[0]);
+    return Pos >= 0 && !LiveFunctions[Owners[Pos]];
+}
 
-        if (Inst->isJumpInst() || Inst->OpNum == PUSHTRAP)
-            CBlock->setNext(Function->Blocks[Inst->getDestIdx()], true);
+/*
+ * Adds instructions with the stack effect of the closure instruction,
+ * that leave unit instead of the closures. The environment is popped.
+ */
+void GenModuleCreator::addDeadClosure(GenFunction* Function, ZInstruction* Inst,
+                                      vector<ZInstruction*>& Instructions) {
+    auto add = [&](int OpNum, int32_t Arg) {
+        Function->Rewritten.push_back(*Inst);
+        auto NewInst = &Function->Rewritten.back();
+        NewInst->OpNum = OpNum;
+        NewInst->Args[0] = Arg;
+        NewInst->Args[1] = 0;
+        NewInst->Payload = nullptr;
+        Instructions.push_back(NewInst);
+    };
+
+    int NVars = Inst->isClosure() ? Inst->Args[0] : Inst->Args[1];
+    if (NVars > 1) add(POP, NVars - 1);
+    add(CONST0, 0);
+    if (Inst->isClosureRec())
+        for (int i = 0; i < Inst->Args[0]; i++) add(PUSH, 0);
+}
 
-        if (Inst->isSwitch()) {
-            for (auto Dest : Inst->SwitchEntries) {
-                CBlock->setNext(Function->Blocks[Dest], false);
+/*
+ * Removes the blocks that are not reachable from the first block, such
+ * as the ones only reached by a branch BytecodeOptimizer folded
+ */
+void GenModuleCreator::removeUnreachableBlocks(GenFunction* Function) {
+    vector<bool> Reached(Function->Blocks.size(), false);
+    vector<GenBlock*> Worklist(1, Function->FirstBlock);
+    Reached[Function->FirstBlock->Index] = true;
+    while (Worklist.size()) {
+        auto Block = Worklist.back();
+        Worklist.pop_back();
+        for (auto NextBlock : Block->NextBlocks)
+            if (!Reached[NextBlock->Index]) {
+                Reached[NextBlock->Index] = true;
+                Worklist.push_back(NextBlock);
             }
-        }
     }
 
-    Function->removeUnusedBlocks();
+    auto isRemoved = [&](GenBlock* Block) { return !Reached[Block->Index]; };
+    vector<GenBlock*> Kept;
+    for (auto Block : Function->Blocks) {
+        if (isRemoved(Block)) continue;
+        auto& Preds = Block->PreviousBlocks;
+        Preds.erase(remove_if(Preds.begin(), Preds.end(), isRemoved), Preds.end());
+        Kept.push_back(Block);
+    }
+    if (Kept.size() == Function->Blocks.size()) return;
 
+    Function->Blocks = Kept;
+    for (size_t i = 0; i < Kept.size(); i++)
+        Kept[i]->Index = i;
 }
-
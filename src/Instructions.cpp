@@ -1,86 +1,89 @@
 #include <Instructions.hpp>
-#include <deque>
+#include <cstdlib>
 
 using namespace std;
 
-void readInstructions(vector<ZInstruction*>& Instructions, int32_t* TabInst, uint32_t Size) {
-
-    int i = 0;
-    uint32_t Pos = 0;
-    map <int, ZInstruction*> InstPositions;
-    int32_t* TabInstB = TabInst;
+void InstructionStream::scan(int32_t* Code, uint32_t Size) {
+    this->Code = Code;
 
     // Size in words
     Size /= 4;
-    deque <ZInstruction*> InstsToAdjust;
 
-    while (Pos < Size) {
-        // Read instruction
-        // And then fill arguments values
-        ZInstruction* Inst = new ZInstruction();
-        Inst->OrigIdx = (int32_t)(TabInst - TabInstB);
-        Inst->OpNum = toBigEndian(*TabInst++);
-        Pos++;
-        InstPositions[Pos] = Inst;
-        Inst->idx = i;
+    // Count the instructions and the words of their variable length
+    // operands, to allocate them at once
+    IndexOfWord.assign(Size, -1);
+    size_t NbInsts = 0, NbPayloads = 0;
+    for (uint32_t Pos = 0; Pos < Size; NbInsts++) {
+        IndexOfWord[Pos] = NbInsts;
+        auto OpNum = toBigEndian(Code[Pos]);
+        auto Arity = OpArities[OpNum];
+        auto Payload = Arity ? payloadSize(OpNum, toBigEndian(Code[Pos + 1])) : 0;
+        Pos += 1 + Arity + Payload;
+        NbPayloads += Payload;
+    }
+    Insts.resize(NbInsts);
+    Payloads.resize(NbPayloads);
+
+    // Instructions only know where they are, and where their variable
+    // length operands go
+    auto Payload = Payloads.data();
+    for (uint32_t Pos = 0; Pos < Size; Pos++) {
+        if (IndexOfWord[Pos] < 0) continue;
+        auto Inst = &Insts[IndexOfWord[Pos]];
+        Inst->OrigIdx = Pos;
+        Inst->idx = IndexOfWord[Pos];
+        Inst->OpNum = toBigEndian(Code[Pos]);
         Inst->Annotation = NOTHING;
-
-        for (int j = 0; j < Inst->Arity(); j++) {
-
-            int32_t ArgVal = toBigEndian(*TabInst);
-
-            if (Inst->hasCodeOffset() && Inst->getCodeOffsetArgIdx() == j) {
-                ArgVal = Pos + ArgVal + 1;
-                InstsToAdjust.push_back(Inst);
-            }
-
-            Inst->Args[j] = ArgVal;
-            Pos++;
-            TabInst++;
+        Inst->Payload = nullptr;
+        if (Inst->isClosureRec() || Inst->isSwitch()) {
+            Inst->Payload = Payload;
+            Payload += payloadSize(Inst->OpNum, toBigEndian(Code[Pos + 1]));
         }
+    }
+}
 
-        if (Inst->OpNum == CLOSUREREC) {
-            Pos++;
-            for (int j = 0; j < Inst->Args[0]; j++) {
-                auto ArgVal = toBigEndian(*TabInst++);
-                Inst->ClosureRecFns[j] = Pos + ArgVal;
-            }
-            Pos += Inst->Args[0] -1;
-            InstsToAdjust.push_back(Inst);
-        }
+/*
+ * Index of the instruction at the given word offset
+ */
+int32_t InstructionStream::indexOfTarget(int32_t Word) {
+    if (Word < 0 || (size_t)Word >= IndexOfWord.size() || IndexOfWord[Word] < 0) {
+        std::cerr << "Jump to word " << Word << ", which is not an instruction\n";
+        exit(1);
+    }
+    return IndexOfWord[Word];
+}
 
-        if (Inst->OpNum == SWITCH) {
-            Pos++;
-            auto NumSwitchEntries = (Inst->Args[0] >> 16) + (Inst->Args[0] & 0XFFFF);
-            for (int j = 0; j < NumSwitchEntries; j++) {
-                auto ArgVal = toBigEndian(*TabInst++);
-                Inst->SwitchEntries.push_back(Pos + ArgVal);
-            }
-            Pos += NumSwitchEntries - 1;
-            InstsToAdjust.push_back(Inst);
+/*
+ * Code offsets are relative to the word holding them, or to the first
+ * operand for CLOSUREREC and SWITCH, and become instruction indexes
+ */
+void InstructionStream::decode() {
+    for (auto& I : Insts) {
+        auto Inst = &I;
+        auto Word = Code + Inst->OrigIdx + 1;
+        int CodeOffsetArg = Inst->getCodeOffsetArgIdx();
+        for (int j = 0; j < Inst->Arity(); j++) {
+            int32_t Pos = Inst->OrigIdx + 1 + j;
+            Inst->Args[j] = toBigEndian(*Word++);
+            if (j == CodeOffsetArg)
+                Inst->Args[j] = indexOfTarget(Pos + Inst->Args[j]);
         }
 
-        i++;
-        Instructions.push_back(Inst);
+        int32_t PayloadStart = Inst->OrigIdx + 1 + Inst->Arity();
+        for (auto& Operand : Inst->payload())
+            Operand = indexOfTarget(PayloadStart + toBigEndian(*Word++));
     }
+}
 
-    for (auto Inst : InstsToAdjust) {
-        if (Inst->OpNum == CLOSUREREC) {
-            for (int j = 0; j < Inst->Args[0]; j++) {
-                Inst->ClosureRecFns[j] = InstPositions[Inst->ClosureRecFns[j]]->idx;
-            }
-        } else if (Inst->OpNum == SWITCH) {
-            int j = 0;
-            for (auto Pos : Inst->SwitchEntries) {
-                Inst->SwitchEntries[j] = InstPositions[Pos]->idx;
-                j++;
-            }
-        } else {
-            int ArgIdx = Inst->getCodeOffsetArgIdx();
-            Inst->Args[ArgIdx] = InstPositions[Inst->Args[ArgIdx]]->idx;
-        }
-    }
+void readInstructions(InstructionStream& Stream, vector<ZInstruction*>& Instructions,
+                      int32_t* TabInst, uint32_t Size) {
+    Stream.scan(TabInst, Size);
+    if (Stream.Insts.empty()) return;
+    Stream.decode();
 
+    Instructions.reserve(Instructions.size() + Stream.Insts.size());
+    for (auto& Inst : Stream.Insts)
+        Instructions.push_back(&Inst);
 }
 
 void annotateNodes(vector<ZInstruction*>& Instructions) {
@@ -90,11 +93,11 @@ void annotateNodes(vector<ZInstruction*>& Instructions) {
             Instructions[Inst->getDestIdx()]->Annotation = FUNCTION_START;
         } 
         if (Inst->isClosureRec()) {
-            for (int j = 0; j < Inst->Args[0]; j++)
-                Instructions[Inst->ClosureRecFns[j]]->Annotation = FUNCTION_START;
+            for (auto Fn : Inst->closureRecFns())
+                Instructions[Fn]->Annotation = FUNCTION_START;
         } 
         if (Inst->isSwitch()) {
-            for (auto Dest : Inst->SwitchEntries)
+            for (auto Dest : Inst->switchEntries())
                 Instructions[Dest]->Annotation = BLOCK_START;
         }
         if (Inst->OpNum == PUSHTRAP) {
@@ -107,3 +110,39 @@ void annotateNodes(vector<ZInstruction*>& Instructions) {
     }
 
 }
+
+int ZInstruction::stackEffect() {
+    switch (OpNum) {
+        case POP: return -Args[0];
+        case PUSH_RETADDR: return 3;
+        case APPLY: return -(Args[0] + 3);
+        case APPLY1: return -1;
+        case APPLY2: return -2;
+        case APPLY3: return -3;
+        case CLOSURE: return Args[0] > 0 ? -(Args[0] - 1) : 0;
+        case CLOSUREREC: return (Args[1] > 0 ? -(Args[1] - 1) : 0) + Args[0];
+        case MAKEBLOCK: return -(Args[0] - 1);
+        case MAKEBLOCK2: return -1;
+        case MAKEBLOCK3: return -2;
+        case MAKEFLOATBLOCK: return -(Args[0] - 1);
+        case SETFIELD0: case SETFIELD1: case SETFIELD2:
+        case SETFIELD3: case SETFIELD: case SETFLOATFIELD:
+            return -1;
+        case GETVECTITEM: case GETSTRINGCHAR: return -1;
+        case SETVECTITEM: case SETSTRINGCHAR: return -2;
+        case PUSHTRAP: return 4;
+        case POPTRAP: return -4;
+        case C_CALL2: return -1;
+        case C_CALL3: return -2;
+        case C_CALL4: return -3;
+        case C_CALL5: return -4;
+        case C_CALLN: return -(Args[0] - 1);
+        case ADDINT: case SUBINT: case MULINT: case DIVINT: case MODINT:
+        case ANDINT: case ORINT: case XORINT: case LSLINT: case LSRINT: case ASRINT:
+        case EQ: case NEQ: case LTINT: case LEINT: case GTINT: case GEINT:
+        case ULTINT: case UGEINT:
+            return -1;
+        default:
+            return pushesAccu() ? 1 : 0;
+    }
+}
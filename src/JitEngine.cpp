@@ -0,0 +1,90 @@
+#include <JitEngine.hpp>
+#include <Utils.hpp>
+#include <unordered_map>
+
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetOptions.h"
+
+extern "C" {
+    #include <ocaml_runtime/prims.h>
+}
+
+using namespace std;
+using namespace llvm;
+
+/*
+ * Address of an external function of the generated code: a primitive of
+ * the OCaml runtime, or another symbol of Z3 and the libraries it uses
+ */
+static void* resolveSymbol(const string& Name) {
+    static unordered_map<string, void*> Primitives;
+    if (Primitives.empty())
+        for (int i = 0; caml_names_of_builtin_cprim[i]; i++)
+            Primitives[caml_names_of_builtin_cprim[i]] = (void*)caml_builtin_cprim[i];
+
+    auto PrimP = Primitives.find(Name);
+    if (PrimP != Primitives.end())
+        return PrimP->second;
+    return sys::DynamicLibrary::SearchForAddressOfSymbol(Name);
+}
+
+JitEngine::JitEngine(GenModule* Mod) {
+    this->Mod = Mod;
+
+    InitializeNativeTarget();
+    TargetOptions TargOps;
+    TargOps.GuaranteedTailCallOpt = 1;
+    TargOps.JITExceptionHandling = 1;
+    string ErrStr;
+    Engine = EngineBuilder(Mod->TheModule).setErrorStr(&ErrStr)
+                                          .setTargetOptions(TargOps)
+                                          .create();
+    if (!Engine) {
+        cerr << "Could not create ExecutionEngine: " << ErrStr << endl;
+        exit(1);
+    }
+    Engine->DisableLazyCompilation(false);
+    Engine->DisableSymbolSearching();
+    Engine->InstallLazyFunctionCreator(resolveSymbol);
+    Engine->RegisterJITEventListener(this);
+}
+
+void* JitEngine::getPointerToFunction(Function* Func) {
+    startEmission();
+    auto Ptr = Engine->getPointerToFunction(Func);
+    freeEmittedIR();
+    return Ptr;
+}
+
+void* JitEngine::getPointerToGlobal(GlobalValue* Global) {
+    return Engine->getPointerToGlobal(Global);
+}
+
+const TargetData* JitEngine::getTargetData() {
+    return Engine->getTargetData();
+}
+
+/*
+ * Calls to emitted functions use their address, which the JIT keeps.
+ * StdLib helpers are kept, they are inlined in the next functions.
+ */
+void JitEngine::freeEmittedIR() {
+    for (auto Func : Emitted)
+        Func->deleteBody();
+    Emitted.clear();
+}
+
+void JitEngine::startEmission() {
+    EmitStart = Timing::Clock::now();
+}
+
+void JitEngine::NotifyFunctionEmitted(const Function& Func, void* Code, size_t Size,
+                                      const EmittedFunctionDetails& Details) {
+    Timing::add("native emission", EmitStart);
+    Timing::count("emitted functions", 1);
+    Timing::count("emitted code bytes", Size);
+    startEmission();
+    if (Mod->GenFunctions.count(&Func))
+        Emitted.push_back(const_cast<Function*>(&Func));
+}
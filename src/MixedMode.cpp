@@ -0,0 +1,156 @@
+#include <MixedMode.hpp>
+#include <JitEngine.hpp>
+#include <Utils.hpp>
+
+extern "C" {
+    #include <ocaml_runtime/fix_code.h>
+    #include <ocaml_runtime/interp.h>
+    #include <ocaml_runtime/prims.h>
+    #include <ocaml_runtime/fail.h>
+}
+
+using namespace std;
+using namespace llvm;
+
+// The hooks are plain C function pointers
+static MixedEngine* Engine = nullptr;
+
+static code_t interpHook(code_t Pc) {
+    return Engine->onInterpEntry(Pc);
+}
+
+static void* jitCodeHook(code_t Code) {
+    return Engine->onJitApply(Code);
+}
+
+MixedEngine::MixedEngine(GenModule* Mod, int Threshold) {
+    this->Mod = Mod;
+    this->Threshold = Threshold;
+    this->InterpApply = nullptr;
+    this->JitEnterPrim = 0;
+
+    for (auto FuncP : Mod->Functions) {
+        auto Func = FuncP.second;
+        auto Info = new FunctionInfo();
+        Info->Func = Func;
+        Info->Count = 0;
+        Info->ZamEntry = nullptr;
+        Info->RestartEntry = nullptr;
+        Info->Stub = nullptr;
+        Info->StubEntry = nullptr;
+
+        auto Entry = caml_start_code + Func->codeOffset();
+        Entries[Entry] = Info;
+        if (Func->Arity > 1)
+            Entries[Entry - 1] = Info;
+
+        // Loops of the function check signals at each iteration
+        for (auto Block : Func->Blocks)
+            for (auto Inst : Block->Instructions)
+                if (Inst->OpNum == CHECK_SIGNALS)
+                    LoopHeads[caml_start_code + Inst->OrigIdx + 1] = Info;
+    }
+}
+
+/*
+ * Compiles the function, and creates the stub used by the interpreter
+ * to call it
+ */
+void MixedEngine::compile(FunctionInfo* Info) {
+    auto Func = Info->Func;
+    auto ExecEngine = Mod->ExecEngine;
+
+    Info->ZamEntry = ExecEngine->getPointerToFunction(Func->getLlvmFunc());
+    if (Func->RestartFunction)
+        Info->RestartEntry = ExecEngine->getPointerToFunction(Func->RestartFunction);
+    makeStub(Info);
+
+    DEBUG(cout << "Compiled " << Func->name() << " after " << Info->Count << " calls\n";)
+}
+
+/*
+ * Bytecode of the stub, with the GRAB of the function:
+ *     RESTART; GRAB arity-1
+ *     OFFSETCLOSURE0; C_CALLN arity+1 jitEnter
+ *     RETURN 0
+ * jitEnter gets the closure and the arguments, and pops them. RETURN then
+ * applies the result to the extra arguments, if any.
+ * The runtime is built without threaded code, so opcodes are stored as is.
+ */
+void MixedEngine::makeStub(FunctionInfo* Info) {
+    int Arity = Info->Func->Arity;
+    auto Stub = new opcode_t[9];
+    int i = 0;
+
+    if (Arity > 1) {
+        Stub[i++] = RESTART;
+        Stub[i++] = GRAB;
+        Stub[i++] = Arity - 1;
+    }
+    Info->StubEntry = Stub + (Arity > 1 ? 1 : 0);
+    Stub[i++] = OFFSETCLOSURE0;
+    Stub[i++] = C_CALLN;
+    Stub[i++] = Arity + 1;
+    Stub[i++] = JitEnterPrim;
+    Stub[i++] = RETURN;
+    Stub[i++] = 0;
+    Info->Stub = Stub;
+}
+
+/*
+ * Called by the interpreter on function entries and loop iterations.
+ * Entries of compiled functions go to their stub.
+ */
+code_t MixedEngine::onInterpEntry(code_t Pc) {
+    auto EntryP = Entries.find(Pc);
+    if (EntryP != Entries.end()) {
+        auto Info = EntryP->second;
+        if (!Info->Stub && ++Info->Count >= Threshold)
+            compile(Info);
+        if (!Info->Stub)
+            return Pc;
+        return Pc == caml_start_code + Info->Func->codeOffset() ? Info->StubEntry : Info->Stub;
+    }
+
+    auto LoopP = LoopHeads.find(Pc);
+    if (LoopP != LoopHeads.end())
+        LoopP->second->Count++;
+    return Pc;
+}
+
+/*
+ * Code to call for a closure applied by generated code
+ */
+void* MixedEngine::onJitApply(code_t Code) {
+    auto EntryP = Entries.find(Code);
+    if (EntryP == Entries.end())
+        return InterpApply;
+
+    auto Info = EntryP->second;
+    if (!Info->Stub && ++Info->Count >= Threshold)
+        compile(Info);
+    if (!Info->Stub)
+        return InterpApply;
+    return Code == caml_start_code + Info->Func->codeOffset() ? Info->ZamEntry : Info->RestartEntry;
+}
+
+/*
+ * Runs the program in the interpreter. Returns its result, which may be
+ * an exception result.
+ */
+value MixedEngine::run() {
+    auto ExecEngine = Mod->ExecEngine;
+    Engine = this;
+
+    InterpApply = ExecEngine->getPointerToFunction(Mod->getFunction("interpApply"));
+    auto JitEnter = ExecEngine->getPointerToFunction(Mod->getFunction("jitEnter"));
+    JitEnterPrim = caml_prim_table.size;
+    caml_ext_table_add(&caml_prim_table, JitEnter);
+
+    auto CodeHookVar = ExecEngine->getPointerToGlobal(Mod->getGlobalVariable("jitCodeHook"));
+    *(void**)CodeHookVar = (void*)jitCodeHook;
+    caml_raise_hook = (void (*)(value))ExecEngine->getPointerToFunction(Mod->getFunction("raiseFromC"));
+    caml_interp_hook = interpHook;
+
+    return caml_interprete(caml_start_code, caml_code_size);
+}
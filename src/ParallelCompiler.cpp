@@ -0,0 +1,142 @@
+#include <ParallelCompiler.hpp>
+#include <Utils.hpp>
+#include <Timing.hpp>
+#include <algorithm>
+#include <thread>
+
+#include "llvm/LLVMContext.h"
+#include "llvm/Linker.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace std;
+using namespace llvm;
+
+ParallelCompiler::ParallelCompiler(GenModule* Mod, vector<ZInstruction*>* Instructions, int Threads) {
+    this->Mod = Mod;
+    this->Instructions = Instructions;
+    this->Threads = Threads;
+    Partitions.resize(Threads);
+    Bitcodes.resize(Threads);
+}
+
+/*
+ * Gives each function to the worker with the fewest instructions so far,
+ * the largest functions first
+ */
+void ParallelCompiler::partition() {
+    vector<pair<size_t, int>> Sizes;
+    for (auto FuncP : Mod->Functions) {
+        size_t Size = 0;
+        for (auto Block : FuncP.second->Blocks)
+            Size += Block->Instructions.size();
+        Sizes.push_back(make_pair(Size, FuncP.first));
+    }
+    sort(Sizes.rbegin(), Sizes.rend());
+
+    vector<size_t> Loads(Threads, 0);
+    for (auto SizeP : Sizes) {
+        int Worker = min_element(Loads.begin(), Loads.end()) - Loads.begin();
+        Partitions[Worker].push_back(SizeP.second);
+        Loads[Worker] += SizeP.first;
+    }
+}
+
+/*
+ * Runs in the thread of the worker
+ */
+void ParallelCompiler::compilePartition(int Worker) {
+    LLVMContext Context;
+    setCodeGenContext(&Context);
+
+    GenModuleCreator GMC(Instructions, false);
+    auto WorkerMod = GMC.generate(0);
+    WorkerMod->Locals = Mod->Locals;
+    WorkerMod->setOptLevel(Mod->OptLevel);
+    WorkerMod->Mixed = Mod->Mixed;
+    WorkerMod->ProfileGen = Mod->ProfileGen;
+    WorkerMod->ProfileUse = Mod->ProfileUse;
+
+    set<Function*> Generated;
+    for (int Id : Partitions[Worker]) {
+        auto Func = WorkerMod->Functions[Id];
+        WorkerMod->compileFunction(Func);
+        Generated.insert(Func->LlvmFunc);
+        Generated.insert(Func->NativeFunc);
+        Generated.insert(Func->RestartFunction);
+    }
+
+    // The module that is run imports the StdLib functions and globals
+    // itself. Internal ones are renamed by the linker.
+    for (Function& Func : *WorkerMod->TheModule)
+        if (!Func.isDeclaration() && !Func.hasLocalLinkage() && !Generated.count(&Func))
+            Func.deleteBody();
+    for (GlobalVariable& Global : WorkerMod->TheModule->getGlobalList()) {
+        if (Global.isDeclaration() || Global.hasLocalLinkage()) continue;
+        Global.setInitializer(nullptr);
+        Global.setLinkage(GlobalValue::ExternalLinkage);
+    }
+
+    raw_string_ostream Out(Bitcodes[Worker]);
+    WriteBitcodeToFile(WorkerMod->TheModule, Out);
+    Out.flush();
+
+    delete WorkerMod->FPM;
+    delete WorkerMod->Builder;
+    delete WorkerMod->TheModule;
+    setCodeGenContext(nullptr);
+}
+
+void ParallelCompiler::link(int Worker) {
+    string ErrStr;
+    auto Buffer = MemoryBuffer::getMemBuffer(Bitcodes[Worker]);
+    auto WorkerModule = ParseBitcodeFile(Buffer, getGlobalContext(), &ErrStr);
+    delete Buffer;
+    if (!WorkerModule ||
+        Linker::LinkModules(Mod->TheModule, WorkerModule, Linker::DestroySource, &ErrStr)) {
+        cerr << "Could not link the module of worker " << Worker << ": " << ErrStr << endl;
+        exit(1);
+    }
+    delete WorkerModule;
+    Bitcodes[Worker].clear();
+}
+
+/*
+ * Generates all the functions of Mod but main. The machine code is still
+ * emitted by the JIT, which is single threaded.
+ */
+void ParallelCompiler::run() {
+    llvm_start_multithreaded();
+    partition();
+
+    vector<thread> Workers;
+    for (int i = 0; i < Threads; i++)
+        Workers.push_back(thread(&ParallelCompiler::compilePartition, this, i));
+    auto Start = Timing::Clock::now();
+    for (auto& Worker : Workers)
+        Worker.join();
+    Timing::add("waiting for the workers", Start);
+
+    Start = Timing::Clock::now();
+    for (int i = 0; i < Threads; i++)
+        link(i);
+    Mod->resolveStdLib();
+    Timing::add("linking the worker modules", Start);
+
+    // The functions of Mod now refer to the linked code
+    auto TheModule = Mod->TheModule;
+    for (auto FuncP : Mod->Functions) {
+        auto Func = FuncP.second;
+        Func->LlvmFunc = TheModule->getFunction(Func->name());
+        Func->NativeFunc = TheModule->getFunction(Func->name() + "_Native");
+        Func->RestartFunction = TheModule->getFunction(Func->name() + "_Restart");
+        Func->Native = Func->hasNativeEntry();
+        Func->Generated = true;
+        for (auto LlvmFunc : {Func->LlvmFunc, Func->NativeFunc, Func->RestartFunction})
+            if (LlvmFunc) Mod->GenFunctions[LlvmFunc] = Func;
+    }
+
+    DEBUG(cout << "Generated " << Mod->Functions.size() << " functions on " << Threads << " threads\n";)
+}
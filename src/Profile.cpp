@@ -0,0 +1,49 @@
+#include <Profile.hpp>
+#include <Utils.hpp>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+uint64_t* Profile::counter(Kind K, int32_t Offset) {
+    lock_guard<mutex> Guard(Lock);
+    return &Counts[make_pair((char)K, Offset)];
+}
+
+bool Profile::has(Kind K, int32_t Offset) {
+    lock_guard<mutex> Guard(Lock);
+    return Counts.count(make_pair((char)K, Offset));
+}
+
+uint64_t Profile::count(Kind K, int32_t Offset) {
+    lock_guard<mutex> Guard(Lock);
+    auto CountP = Counts.find(make_pair((char)K, Offset));
+    return CountP == Counts.end() ? 0 : CountP->second;
+}
+
+/*
+ * Counts of the file are added to the ones already there, so that the
+ * profiles of several runs can be merged
+ */
+bool Profile::load(const string& Path) {
+    ifstream In(Path);
+    if (!In) return false;
+
+    char K;
+    int32_t Offset;
+    uint64_t Count;
+    lock_guard<mutex> Guard(Lock);
+    while (In >> K >> Offset >> Count)
+        Counts[make_pair(K, Offset)] += Count;
+
+    DEBUG(cout << "Read " << Counts.size() << " counts from " << Path << endl;)
+    return In.eof();
+}
+
+bool Profile::save(const string& Path) {
+    ofstream Out(Path);
+    lock_guard<mutex> Guard(Lock);
+    for (auto CountP : Counts)
+        Out << CountP.first.first << " " << CountP.first.second << " " << CountP.second << "\n";
+    return Out.good();
+}
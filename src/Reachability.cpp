@@ -0,0 +1,293 @@
+#include <Reachability.hpp>
+#include <algorithm>
+
+using namespace std;
+
+// ================ Abstract state ================== //
+
+int ReachabilityAnalysis::State::slot(int n) {
+    return n >= 0 && n < (int)Stack.size() ? Stack[Stack.size() - 1 - n] : 0;
+}
+
+void ReachabilityAnalysis::State::push(int Val) {
+    Stack.push_back(Val);
+}
+
+// Slots below the followed ones hold values that escaped
+void ReachabilityAnalysis::State::pop(int n) {
+    Stack.resize(Stack.size() - min((size_t)max(n, 0), Stack.size()));
+}
+
+// ================ Values ================== //
+
+int ReachabilityAnalysis::positionOf(int32_t Idx) {
+    if (Idx < 0 || Idx >= (int32_t)Positions.size()) return -1;
+    return Positions[Idx];
+}
+
+/*
+ * Function whose entry is the instruction Idx, or -1 if it is not generated
+ */
+int ReachabilityAnalysis::functionAt(int32_t Idx) {
+    int Pos = positionOf(Idx);
+    return Pos >= 0 ? Owners[Pos] : -1;
+}
+
+int ReachabilityAnalysis::makeValue(bool IsBlock, const vector<int>& Fns, const vector<int>& Fields) {
+    Values.push_back(Value{IsBlock, false, Fns, Fields});
+    return Values.size() - 1;
+}
+
+int ReachabilityAnalysis::global(int32_t n) {
+    return n >= 0 && n < (int32_t)Globals.size() ? Globals[n] : 0;
+}
+
+/*
+ * Value of the field n of Val. The fields of anything but a block made
+ * by main are not followed, and Val escapes.
+ */
+int ReachabilityAnalysis::fieldOf(int Val, int32_t n) {
+    if (Values[Val].IsBlock && n >= 0 && n < (int32_t)Values[Val].Fields.size())
+        return Values[Val].Fields[n];
+    escape(Val);
+    return 0;
+}
+
+void ReachabilityAnalysis::escape(int Val) {
+    vector<int> ToEscape(1, Val);
+    while (ToEscape.size()) {
+        int Cur = ToEscape.back();
+        ToEscape.pop_back();
+        if (Cur == 0 || Values[Cur].Escaped) continue;
+        Values[Cur].Escaped = true;
+        for (auto Fn : Values[Cur].Fns) reach(Fn);
+        for (auto Field : Values[Cur].Fields) ToEscape.push_back(Field);
+    }
+}
+
+void ReachabilityAnalysis::escapeAll(State& S) {
+    escape(S.Accu);
+    for (auto Val : S.Stack) escape(Val);
+}
+
+void ReachabilityAnalysis::reach(int Fn) {
+    if (Fn < 0 || Reached[Fn]) return;
+    Reached[Fn] = true;
+    Worklist.push_back(Fn);
+}
+
+/*
+ * Joins the state From flowing to an instruction with the state Into
+ * already there. Values that differ escape.
+ */
+void ReachabilityAnalysis::join(State& Into, State& From) {
+    if (!From.Live) return;
+    if (!Into.Live) {
+        Into = From;
+        return;
+    }
+    if (Into.Stack.size() != From.Stack.size()) {
+        escapeAll(Into);
+        escapeAll(From);
+        Into = State{true, 0, vector<int>()};
+        return;
+    }
+    if (Into.Accu != From.Accu) {
+        escape(Into.Accu);
+        escape(From.Accu);
+        Into.Accu = 0;
+    }
+    for (size_t i = 0; i < Into.Stack.size(); i++)
+        if (Into.Stack[i] != From.Stack[i]) {
+            escape(Into.Stack[i]);
+            escape(From.Stack[i]);
+            Into.Stack[i] = 0;
+        }
+}
+
+/*
+ * The state S flows from the instruction at Pos to the one at DestIdx.
+ * Instructions already visited are not visited again, what flows back to
+ * them escapes.
+ */
+void ReachabilityAnalysis::flowTo(int Pos, int32_t DestIdx, State& S) {
+    int Dest = positionOf(DestIdx);
+    if (Dest > Pos) join(Pending[Dest], S);
+    else escapeAll(S);
+}
+
+// ================ Main function ================== //
+
+void ReachabilityAnalysis::step(int Pos, State& S) {
+    ZInstruction* Inst = Instructions[Pos];
+    int OpNum = Inst->OpNum;
+
+    // PUSH* instructions then do the operation of their non push version
+    if (Inst->pushesAccu()) S.push(S.Accu);
+
+    switch (OpNum) {
+        case PUSH:
+            break;
+
+        case ACC0: case ACC1: case ACC2: case ACC3:
+        case ACC4: case ACC5: case ACC6: case ACC7:
+            S.Accu = S.slot(OpNum - ACC0); break;
+        case PUSHACC0: case PUSHACC1: case PUSHACC2: case PUSHACC3:
+        case PUSHACC4: case PUSHACC5: case PUSHACC6: case PUSHACC7:
+            S.Accu = S.slot(OpNum - PUSHACC0); break;
+        case ACC: case PUSHACC:
+            S.Accu = S.slot(Inst->Args[0]); break;
+
+        case POP:
+            S.pop(Inst->Args[0]); break;
+
+        // The old value of the slot may still be seen by an exception
+        // handler, or at the start of a loop
+        case ASSIGN: {
+            escape(S.Accu);
+            int n = Inst->Args[0];
+            if (n < (int)S.Stack.size()) S.Stack[S.Stack.size() - 1 - n] = S.Accu;
+            S.Accu = 0;
+            break;
+        }
+
+        case CONST0: case CONST1: case CONST2: case CONST3: case CONSTINT:
+        case PUSHCONST0: case PUSHCONST1: case PUSHCONST2: case PUSHCONST3: case PUSHCONSTINT:
+        case ATOM0: case ATOM: case PUSHATOM0: case PUSHATOM:
+        case ENVACC1: case ENVACC2: case ENVACC3: case ENVACC4: case ENVACC:
+        case PUSHENVACC1: case PUSHENVACC2: case PUSHENVACC3: case PUSHENVACC4: case PUSHENVACC:
+            S.Accu = 0; break;
+
+        case GETGLOBAL: case PUSHGETGLOBAL:
+            S.Accu = global(Inst->Args[0]); break;
+        case GETGLOBALFIELD: case PUSHGETGLOBALFIELD:
+            S.Accu = fieldOf(global(Inst->Args[0]), Inst->Args[1]); break;
+        case SETGLOBAL: {
+            int n = Inst->Args[0];
+            escape(global(n));
+            if (n >= (int)Globals.size()) Globals.resize(n + 1, 0);
+            Globals[n] = S.Accu;
+            S.Accu = 0;
+            break;
+        }
+
+        case GETFIELD0: case GETFIELD1: case GETFIELD2: case GETFIELD3:
+            S.Accu = fieldOf(S.Accu, OpNum - GETFIELD0); break;
+        case GETFIELD:
+            S.Accu = fieldOf(S.Accu, Inst->Args[0]); break;
+
+        case MAKEBLOCK: case MAKEBLOCK1: case MAKEBLOCK2: case MAKEBLOCK3: {
+            int Size = OpNum == MAKEBLOCK ? Inst->Args[0] : OpNum - MAKEBLOCK1 + 1;
+            vector<int> Fields(1, S.Accu);
+            for (int i = 0; i < Size - 1; i++) Fields.push_back(S.slot(i));
+            S.pop(Size - 1);
+            S.Accu = makeValue(true, vector<int>(), Fields);
+            break;
+        }
+
+        // The environment is the accumulator and the top of the stack
+        case CLOSURE: case CLOSUREREC: {
+            vector<int> Fns;
+            if (Inst->isClosure()) Fns.push_back(functionAt(Inst->getDestIdx()));
+            else for (auto Fn : Inst->closureRecFns()) Fns.push_back(functionAt(Fn));
+            Fns.erase(remove(Fns.begin(), Fns.end(), -1), Fns.end());
+
+            int NVars = Inst->isClosure() ? Inst->Args[0] : Inst->Args[1];
+            if (NVars > 0) S.push(S.Accu);
+            vector<int> Env;
+            for (int i = 0; i < NVars; i++) Env.push_back(S.slot(i));
+            S.pop(NVars);
+            S.Accu = makeValue(false, Fns, Env);
+
+            // The closures of a recursive group share their block
+            if (Inst->isClosureRec())
+                for (int i = 0; i < Inst->Args[0]; i++) S.push(S.Accu);
+            break;
+        }
+
+        // The handler is entered with the stack of PUSHTRAP
+        case PUSHTRAP: {
+            State Handler = S;
+            Handler.Accu = 0;
+            flowTo(Pos, Inst->getDestIdx(), Handler);
+            for (int i = 0; i < 4; i++) S.push(0);
+            break;
+        }
+
+        // Anything else reads the accumulator and the slots it pops in a
+        // way that is not followed
+        default: {
+            int Effect = Inst->stackEffect() - (Inst->pushesAccu() ? 1 : 0);
+            if (!Inst->ignoresAccu()) escape(S.Accu);
+            for (int i = 0; i < -Effect; i++) escape(S.slot(i));
+            if (OpNum == GETMETHOD || OpNum == GETDYNMET) escape(S.slot(0));
+            S.pop(-Effect);
+            for (int i = 0; i < Effect; i++) S.push(0);
+            if (!Inst->ignoresAccu()) S.Accu = 0;
+
+            if (Inst->isJumpInst()) flowTo(Pos, Inst->getDestIdx(), S);
+            if (Inst->isSwitch())
+                for (auto Case : Inst->switchEntries())
+                    flowTo(Pos, Case, S);
+            if (Inst->isUncondJump() || Inst->isReturn() || Inst->isSwitch())
+                S.Live = false;
+            break;
+        }
+    }
+}
+
+void ReachabilityAnalysis::scanMain(const vector<int32_t>& MainPositions) {
+    State S{true, 0, vector<int>()};
+    int PrevPos = -1;
+    for (auto Pos : MainPositions) {
+        if (PrevPos >= 0 && PrevPos + 1 != Pos) S.Live = false;
+        auto PendingIt = Pending.find(Pos);
+        if (PendingIt != Pending.end()) {
+            join(S, PendingIt->second);
+            Pending.erase(PendingIt);
+        }
+
+        // Only reached by jumping back, what flows there escaped
+        if (!S.Live) S = State{true, 0, vector<int>()};
+
+        step(Pos, S);
+        PrevPos = Pos;
+    }
+}
+
+// ================ Other functions ================== //
+
+void ReachabilityAnalysis::scanFunction(const vector<int32_t>& FuncPositions) {
+    for (auto Pos : FuncPositions) {
+        ZInstruction* Inst = Instructions[Pos];
+        switch (Inst->OpNum) {
+            case CLOSURE:
+                reach(functionAt(Inst->getDestIdx()));
+                break;
+            case CLOSUREREC:
+                for (auto Fn : Inst->closureRecFns()) reach(functionAt(Fn));
+                break;
+            case GETGLOBAL: case PUSHGETGLOBAL:
+                escape(global(Inst->Args[0]));
+                break;
+            case GETGLOBALFIELD: case PUSHGETGLOBALFIELD:
+                escape(fieldOf(global(Inst->Args[0]), Inst->Args[1]));
+                break;
+        }
+    }
+}
+
+vector<bool> ReachabilityAnalysis::run(const vector<vector<int32_t>>& FuncPositions) {
+    Reached.assign(FuncPositions.size(), false);
+    Reached[0] = true;
+    // Value 0, for everything that is not followed
+    Values.assign(1, Value{false, true, vector<int>(), vector<int>()});
+
+    scanMain(FuncPositions[0]);
+    while (Worklist.size()) {
+        int Fn = Worklist.back();
+        Worklist.pop_back();
+        scanFunction(FuncPositions[Fn]);
+    }
+    return Reached;
+}
@@ -0,0 +1,14 @@
+#include <Runtime.hpp>
+
+extern "C" void jitRaise() {
+    throw OCamlException();
+}
+
+extern "C" int jitCall(void (*Code)()) {
+    try {
+        Code();
+        return 0;
+    } catch (OCamlException&) {
+        return 1;
+    }
+}
@@ -8,7 +8,7 @@ void SimpleContext::generateMod() {
   std::cout << "SimpleContext::generateMod" << std::endl;
 }
 
-void SimpleContext::compile() {
+void SimpleContext::compile(bool Lazy) {
     std::cout << "SimpleContext::compile: '" << Instructions.size()
               << "' instructions" << std::endl;
 }
@@ -5,6 +5,7 @@
 #include <ocaml_runtime/prims.h>
 #include <ocaml_runtime/fail.h>
 #include <ocaml_runtime/stacks.h>
+#include <ocaml_runtime/callback.h>
 #include <stdio.h>
 
 #define Lookup(obj, lab) Field (Field (obj, 0), Int_val(lab))
@@ -159,6 +160,15 @@ void getDoubleField(value Idx) {
     Store_double_val(Accu, d);
 }
 
+/* Slow path of the allocations inlined in the generated code,
+   called when the minor heap is full. The accumulator and the values
+   held in registers are registered in caml_local_roots by the caller. */
+void minorCollection() {
+    Setup_for_c_call;
+    caml_minor_collection();
+    Restore_after_c_call;
+}
+
 // ================================= GLOBAL DATA ============================ //
 
 void getGlobal(value Idx) {
@@ -175,27 +185,26 @@ void setGlobal(value Idx) {
 
 // ============================ EXCEPTION HANDLING ========================= //
 
-typedef struct _JmpBufList {
-    struct _JmpBufList* Next;
-    struct longjmp_buffer JmpBuf;
-} JmpBufList;
+/*
+ * OCaml exceptions are C++ exceptions thrown by jitRaise (Context.cpp):
+ * generated code catches them in the landing pads of its try blocks, so
+ * entering a try block only pushes a trap frame. The trap frame keeps the
+ * GC roots registered when it was pushed, in place of the unused pc slot.
+ */
+extern void jitRaise(void);
+extern int jitCall(void (*Code)(void));
 
-JmpBufList* NextExceptionContext = NULL;
+/* True while generated code runs, false while the interpreter runs
+   (mixed mode) */
+int InJitCode = 0;
 
-JmpBufList Buffers[2048];
-size_t CurrentBufferIndex = 0;
-
-char* getNewBuffer() {
-    JmpBufList* NewContext = &Buffers[CurrentBufferIndex++];
-    NewContext->Next = NextExceptionContext;
-    NextExceptionContext = NewContext;
-    caml_external_raise = &NewContext->JmpBuf;
-    return (char*)NewContext->JmpBuf.buf;
-}
+void printCallChain(Call* CCall, int depth);
 
 void getExceptionValue() {
     IFDBG(printf("IN GETEXCEPTIONVALUE : %p\n", (void*)Accu);)
     StackPointer = caml_trapsp;
+    // The roots registered by the frames that were left are dropped
+    caml_local_roots = (struct caml__roots_block*)StackPointer[0];
     Env = StackPointer[2];
     caml_trapsp = Trap_link(StackPointer);
     extra_args = Long_val(StackPointer[3]);
@@ -203,39 +212,21 @@ void getExceptionValue() {
     Accu = caml_exn_bucket;
 }
 
-value addExceptionContext() {
-    IFDBG(printf("IN ADD EXCEPTION CONTEXT\n");)
-    JmpBufList* NewContext = malloc(sizeof(JmpBufList));
-    NewContext->Next = NextExceptionContext;
-    NextExceptionContext = NewContext;
-
-    if (sigsetjmp(NewContext->JmpBuf.buf, 0) == 0) {
-        IFDBG(printf("RETURNING FROM ADD EXCEPTION CONTEXT NORMALLY\n");)
-        return 0;
-    } else {
-        IFDBG(printf("RETURNING FROM A THROW\n");)
-        JmpBufList* Ctx = NextExceptionContext;
-        NextExceptionContext = Ctx->Next;
-        free(Ctx);
-        IFDBG(printf("WE OUTTA THERE\n");)
-        return caml_exn_bucket;
-    }
-}
-
-void removeExceptionContext() {
-    JmpBufList* Context = NextExceptionContext;
-    NextExceptionContext = Context->Next;
-    CurrentBufferIndex--;
-    caml_external_raise = &NextExceptionContext->JmpBuf;
-}
-
-void printCallChain(Call* CCall, int depth);
-
 void throwException(value ExcVal) {
     IFDBG(printf("OCamL THROW !!!!!!!!!!!!!!!!\n");)
-    if (!NextExceptionContext) exit(0);
+    if (caml_trapsp >= caml_stack_high) exit(0);
     caml_exn_bucket = ExcVal;
-    siglongjmp(NextExceptionContext->JmpBuf.buf, 1);
+    jitRaise();
+}
+
+/*
+ * Called by caml_raise for exceptions raised by C primitives. The
+ * exception unwinds the generated code up to a try block, or up to the
+ * interpreter that called it. Primitives called by the interpreter go on
+ * with caml_external_raise.
+ */
+void raiseFromC(value ExcVal) {
+    if (InJitCode) jitRaise();
 }
 
 void vectLength() {
@@ -351,6 +342,8 @@ void cmpDebug(value A, value B) {
 
 void init() {
     StackPointer = caml_extern_sp;
+    caml_raise_hook = raiseFromC;
+    InJitCode = 1;
 }
 
 void constInt(value CI) {
@@ -516,16 +509,78 @@ void restart() {
         StackPointer = caml_extern_sp; \
     } 
 
+/* Prologue of the native entries, which are called directly instead of
+   going through the apply helpers */
+void checkStacks() {
+    CHECK_STACKS();
+}
+
 typedef void(*FunctionTy)(void);
 
+// ============================ MIXED MODE ========================= //
+
+/* In mixed mode, closures hold bytecode: the hook gives the compiled code
+   of a function, or interpApply */
+FunctionTy (*jitCodeHook)(code_t) = NULL;
+
+static inline FunctionTy codeOf(value Closure) {
+    if (jitCodeHook) return jitCodeHook(Code_val(Closure));
+    return (FunctionTy)Code_val(Closure);
+}
+
+/*
+ * Code of the closures run by the interpreter, called like compiled code:
+ * the closure is in Accu, and extra_args + 1 arguments are on the stack,
+ * followed by the return frame
+ */
+void interpApply() {
+    int i, NArgs = extra_args + 1, SavedInJit = InJitCode;
+    value Args[NArgs];
+    value Res;
+    for (i = 0; i < NArgs; i++) Args[i] = StackPointer[i];
+    StackPointer += NArgs;
+    caml_extern_sp = StackPointer;
+    InJitCode = 0;
+    Res = caml_callbackN_exn(Accu, NArgs, Args);
+    InJitCode = SavedInJit;
+    StackPointer = caml_extern_sp;
+    if (Is_exception_result(Res)) throwException(Extract_exception(Res));
+    Accu = Res;
+    Env = StackPointer[1];
+    extra_args = Long_val(StackPointer[2]);
+    StackPointer += 3;
+}
+
+/*
+ * Primitive called by the bytecode stub of a compiled function, with its
+ * closure followed by its arguments. The ZAM entry of the function is
+ * called as APPLY would, and its result returned to the interpreter.
+ */
+value jitEnter(value* Args, int NArgs) {
+    int i, Raised, SavedInJit = InJitCode;
+    FunctionTy Code = codeOf(Args[0]);
+    StackPointer = caml_extern_sp - (NArgs + 2);
+    for (i = 1; i < NArgs; i++) StackPointer[i - 1] = Args[i];
+    StackPointer[NArgs - 1] = Val_unit;
+    StackPointer[NArgs] = Val_unit;
+    StackPointer[NArgs + 1] = Val_long(0);
+    Accu = Env = Args[0];
+    extra_args = NArgs - 2;
+    InJitCode = 1;
+    Raised = jitCall(Code);
+    InJitCode = SavedInJit;
+    caml_extern_sp = StackPointer;
+    if (Raised) caml_raise(caml_exn_bucket);
+    return Accu;
+}
+
 FunctionTy apply(value N) {
     IFDBG(printf("APPLY\n");)
     extra_args = N -1;
     IFDBG(printf("IN APPLY\n");)
     IFDBG(printf("{{ EXTRA ARGS = %ld\n", extra_args);)
     Env = Accu;
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy apply1() {
@@ -540,8 +595,7 @@ FunctionTy apply1() {
     extra_args = 0;
     CHECK_STACKS();
     IFDBG(printf("OUT APPLY 1 %d , result : %p\n", cnb, (void*)Accu);)
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy apply2() {
@@ -556,8 +610,7 @@ FunctionTy apply2() {
     Env = Accu;
     extra_args = 1;
     CHECK_STACKS();
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy apply3() {
@@ -573,8 +626,7 @@ FunctionTy apply3() {
     Env = Accu;
     extra_args = 2;
     CHECK_STACKS();
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy appterm(value nargs, value slotsize) {
@@ -588,8 +640,7 @@ FunctionTy appterm(value nargs, value slotsize) {
     Env = Accu;
     extra_args += nargs - 1;
     CHECK_STACKS();
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy appterm1(value slotsize) {
@@ -598,8 +649,7 @@ FunctionTy appterm1(value slotsize) {
     StackPointer[0] = arg1;
     Env = Accu;
     CHECK_STACKS();
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy appterm2(value slotsize) {
@@ -611,8 +661,7 @@ FunctionTy appterm2(value slotsize) {
     Env = Accu;
     extra_args += 1;
     CHECK_STACKS();
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy appterm3(value slotsize) {
@@ -626,8 +675,7 @@ FunctionTy appterm3(value slotsize) {
     Env = Accu;
     extra_args += 2;
     CHECK_STACKS();
-    FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-    return CodePtr;
+    return codeOf(Accu);
 }
 
 FunctionTy handleReturn(value stsz) {
@@ -635,8 +683,7 @@ FunctionTy handleReturn(value stsz) {
     if (extra_args > 0) {
         extra_args--;
         Env = Accu;
-        FunctionTy CodePtr = (FunctionTy)Code_val(Accu);
-        return CodePtr;
+        return codeOf(Accu);
     } else {
         // No partial application
         Env = StackPointer[1];
@@ -649,6 +696,7 @@ FunctionTy handleReturn(value stsz) {
 void pushTrap() {
     StackPointer -= 4;
     Trap_link(StackPointer) = caml_trapsp;
+    StackPointer[0] = (value)caml_local_roots;
     StackPointer[2] = Env;
     IFDBG(printf("IN PUSHTRAP, ENV = %p\n", (void*)Env);)
     StackPointer[3] = Val_long(extra_args);
@@ -0,0 +1,117 @@
+#include <Timing.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <time.h>
+
+#include "llvm/Pass.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace std;
+
+#define SLOWEST_FUNCTIONS 10
+
+bool Timing::Enabled = false;
+
+// Phases and counts in the order they were first seen
+struct TimingData {
+    mutex Lock;
+    vector<pair<string, Timing::Clock>> Phases;
+    vector<pair<string, uint64_t>> Counts;
+    vector<pair<double, string>> Functions;
+};
+
+static TimingData& data() {
+    static TimingData Data;
+    return Data;
+}
+
+template <typename T>
+static T& entry(vector<pair<string, T>>& Entries, const string& Name) {
+    for (auto& EntryP : Entries)
+        if (EntryP.first == Name) return EntryP.second;
+    Entries.push_back(make_pair(Name, T()));
+    return Entries.back().second;
+}
+
+static double seconds(clockid_t Id) {
+    struct timespec Ts;
+    clock_gettime(Id, &Ts);
+    return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+Timing::Clock Timing::Clock::now() {
+    Clock C;
+    C.Wall = seconds(CLOCK_MONOTONIC);
+    C.Cpu = seconds(CLOCK_THREAD_CPUTIME_ID);
+    return C;
+}
+
+Timing::Phase::Phase(const char* Name) : Name(Name), Start() {
+    if (Enabled) Start = Clock::now();
+}
+
+Timing::Phase::~Phase() {
+    add(Name, Start);
+}
+
+void Timing::enable(bool TimePasses) {
+    Enabled = true;
+    llvm::TimePassesIsEnabled = TimePasses;
+    atexit(report);
+}
+
+void Timing::add(const string& Phase, Clock Start) {
+    if (!Enabled) return;
+    auto End = Clock::now();
+    auto& Data = data();
+    lock_guard<mutex> Guard(Data.Lock);
+    auto& Total = entry(Data.Phases, Phase);
+    Total.Wall += End.Wall - Start.Wall;
+    Total.Cpu += End.Cpu - Start.Cpu;
+}
+
+void Timing::addFunction(const string& Name, Clock Start) {
+    if (!Enabled) return;
+    auto Wall = Clock::now().Wall - Start.Wall;
+    auto& Data = data();
+    lock_guard<mutex> Guard(Data.Lock);
+    Data.Functions.push_back(make_pair(Wall, Name));
+}
+
+void Timing::count(const string& Name, uint64_t N) {
+    if (!Enabled) return;
+    auto& Data = data();
+    lock_guard<mutex> Guard(Data.Lock);
+    entry(Data.Counts, Name) += N;
+}
+
+void Timing::report() {
+    auto& Data = data();
+    lock_guard<mutex> Guard(Data.Lock);
+
+    fprintf(stderr, "===== Z3 phases =====\n");
+    fprintf(stderr, "%-32s %10s %10s\n", "Phase", "Wall (s)", "CPU (s)");
+    for (auto PhaseP : Data.Phases)
+        fprintf(stderr, "%-32s %10.4f %10.4f\n", PhaseP.first.c_str(),
+                PhaseP.second.Wall, PhaseP.second.Cpu);
+
+    if (Data.Functions.size()) {
+        fprintf(stderr, "\nSlowest functions to generate:\n");
+        sort(Data.Functions.rbegin(), Data.Functions.rend());
+        for (size_t i = 0; i < Data.Functions.size() && i < SLOWEST_FUNCTIONS; i++)
+            fprintf(stderr, "%-32s %10.4f\n", Data.Functions[i].second.c_str(), Data.Functions[i].first);
+    }
+
+    fprintf(stderr, "\nSizes:\n");
+    for (auto CountP : Data.Counts)
+        fprintf(stderr, "%-32s %10llu\n", CountP.first.c_str(), (unsigned long long)CountP.second);
+    fprintf(stderr, "\n");
+
+    // Reports of the LLVM passes, optimization and native code generation
+    llvm::TimerGroup::printAll(llvm::errs());
+}
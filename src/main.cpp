@@ -3,6 +3,7 @@
 #include <boost/program_options.hpp>
 #include <Context.hpp>
 #include <Utils.hpp>
+#include <Timing.hpp>
 
 namespace po = boost::program_options;
 using namespace std;
@@ -28,10 +29,16 @@ int main(int argc, char** argv) {
 
     int StepToReach = 4;
     int PrintFrom = 0;
+    int Threshold = 1000;
+    int OptLevel = 0;
+    int Threads = 1;
     bool PrintTime = false;
     string ToErase = "0,0";
     int EraseFirst, EraseLast;
     string FileName = "";
+    string AotOutput = "";
+    string ProfileGen = "";
+    string ProfileUse = "";
 
     Options.add_options()
         ("help,h", "Show this help message.")
@@ -40,8 +47,17 @@ int main(int argc, char** argv) {
         ("from,f", po::value<int>(&PrintFrom)->default_value(PrintFrom), "Specify the code offset from which the generation will start.")
         ("erase,e", po::value< string >(&ToErase)->default_value(ToErase), "Specify a range of code offset to erase (2 values expected)\n    positive: from the begining\n    negative: from the end")
         ("verbose,v", "Show debug messages\n")
-        ("opt,o", "Run a basic set of optimization passes")
-        ("time,t", "Print execution time in seconds on stderr")
+        ("opt,o", "Run the optimization passes, same as -O1")
+        ("opt-level,O", po::value<int>(&OptLevel)->default_value(OptLevel), "Set the optimization level, 0 or 1")
+        ("locals,l", "Keep the VM registers in function locals instead of globals")
+        ("time,t", "Print execution time in seconds, and the time and sizes of each phase on stderr")
+        ("mixed,m", "Run in the interpreter and only compile the hot functions")
+        ("threshold", po::value<int>(&Threshold)->default_value(Threshold), "Calls and loop iterations after which a function is compiled in mixed mode")
+        ("threads,j", po::value<int>(&Threads)->default_value(Threads), "Generate and optimize the functions on this many threads")
+        ("cache,c", "Run the native code of the program from the code cache, compiling and storing it on a miss")
+        ("aot", po::value<string>(&AotOutput), "Write the program as a native executable to this file instead of running it")
+        ("profile-gen", po::value<string>(&ProfileGen), "Count the executions of the blocks and calls, and write them to this file at exit")
+        ("profile-use", po::value<string>(&ProfileUse), "Generate the code using the counts of this file, written by --profile-gen")
         ;
 
     Hidden.add_options()
@@ -76,10 +92,33 @@ int main(int argc, char** argv) {
 
     if (VM.count("verbose")) setDBG(1);
 
-    if (VM.count("opt")) ExecContext->Opt = true;
+    if (VM.count("opt")) OptLevel = 1;
+    if (OptLevel < 0 || OptLevel > 1) {
+        cout << "Optimization level " << OptLevel << " is not supported, use 0 or 1\n";
+        usage();
+        return 1;
+    }
+    ExecContext->OptLevel = OptLevel;
+
+    if (VM.count("locals")) ExecContext->Locals = true;
 
     if (VM.count("time")) PrintTime = true;
 
+    // The counters live in Z3, and interpreted code is not counted
+    if (ProfileGen != "" && AotOutput != "") {
+        cout << "--profile-gen cannot be used with --aot\n";
+        usage();
+        return 1;
+    }
+    ExecContext->ProfileGenPath = ProfileGen;
+    ExecContext->ProfileUsePath = ProfileUse;
+
+    // Executables written by --aot do not embed the bytecode
+    if (VM.count("mixed") && AotOutput == "" && ProfileGen == "") ExecContext->Mixed = true;
+    ExecContext->Threshold = Threshold;
+    ExecContext->Threads = Threads;
+    if (PrintTime) Timing::enable(Threads <= 1);
+
     if (FileName == "") {
         cout << "Input file missing\n";
         usage();
@@ -94,8 +133,17 @@ int main(int argc, char** argv) {
     }
 
 
+    // The cache only holds whole programs, compiled as they are run
+    // without a profile
+    if (VM.count("cache") && !ExecContext->Mixed && AotOutput == "" &&
+        PrintFrom == 0 && EraseFirst == EraseLast && ProfileGen == "" && ProfileUse == "")
+        ExecContext->UseCache = true;
+
     ExecContext->init(FileName, PrintFrom, EraseFirst, EraseLast);
-    if (StepToReach > 1) ExecContext->generateMod();
-    if (StepToReach > 2) ExecContext->compile();
-    if (StepToReach > 3) ExecContext->exec(PrintTime);
+    if (!ExecContext->cached()) {
+        if (StepToReach > 1) ExecContext->generateMod();
+        if (StepToReach > 2) ExecContext->compile(StepToReach > 3 && AotOutput == "");
+    }
+    if (StepToReach > 3 && AotOutput != "") ExecContext->aot(AotOutput);
+    else if (StepToReach > 3) ExecContext->exec(PrintTime);
 }
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Time spent building the CFG of programs of increasing size: each one
+# has n functions, with two nested loops and a match each
+
+cd `dirname "$0"`
+for n in 1000 10000 50000; do
+    for i in `seq $n`; do
+        echo "let f$i x y ="
+        echo "  let r = ref 0 in"
+        echo "  for i = 0 to x do"
+        echo "    let j = ref y in"
+        echo "    while !j > 0 do"
+        echo "      (match (i + !j) land 3 with 0 -> incr r | 1 -> r := !r + 2 | _ -> decr j);"
+        echo "      decr j"
+        echo "    done"
+        echo "  done;"
+        echo "  !r"
+    done > cfg.ml
+    echo "let () = print_int (f1 10 10 + f$n 10 10)" >> cfg.ml
+    ocamlc cfg.ml 2>/dev/null
+
+    echo "$n functions"
+    ../bin/Z3 -t -s 2 a.out 2>&1 >/dev/null | grep -E "^(readInstructions|annotateNodes|GenModuleCreator::generate|instructions|blocks|loops) "
+done
+
+rm a.out cfg.*
@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Time spent generating and optimizing all the functions of each bench,
+# with an increasing number of threads
+
+dir=./benches
+cd `dirname "$0"`
+for file in `ls $dir/*.ml`; do
+    if [ "$file" = "$dir/mandelbrot.ml" ]; then
+        ocamlc graphics.cma -dllpath /usr/lib/ocaml/stublibs "$file" 2>/dev/null
+    else
+        ocamlc "$file" 2>/dev/null
+    fi
+
+    echo "$file"
+    for threads in 1 2 4 8; do
+        z3=`/usr/bin/time -f '%e' ../bin/Z3 -o -s 3 -j $threads a.out 2>&1 >/dev/null`
+        echo -en "$threads:\t"
+        echo "$z3" | tail -n 1
+    done
+done
+
+rm  a.out "$dir"/*.cm*
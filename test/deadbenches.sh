@@ -0,0 +1,16 @@
+#!/bin/bash
+
+# Functions dropped as unreachable, and time to build the module, for the
+# tests run without ocamlclean, then with it
+
+cd `dirname "$0"`/testfiles
+for f in *.ml; do
+    ocamlc $f -o a.out 2>/dev/null || continue
+    echo "$f"
+    ../../bin/Z3 -t -s 2 a.out 2>&1 >/dev/null | grep -E "^(GenModuleCreator::generate|functions|dead functions) "
+    ocamlclean a.out -o clean.out
+    echo "$f, with ocamlclean"
+    ../../bin/Z3 -t -s 2 clean.out 2>&1 >/dev/null | grep -E "^(GenModuleCreator::generate|functions|dead functions) "
+done
+
+rm -f a.out clean.out *.cmo *.cmi
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Compile time (-s 3) and run time of each bench at each optimization level
+
+dir=./benches
+cd `dirname "$0"`
+for file in `ls $dir/*.ml`; do
+    if [ "$file" = "$dir/mandelbrot.ml" ]; then
+        ocamlc graphics.cma -dllpath /usr/lib/ocaml/stublibs "$file" 2>/dev/null
+    else
+        ocamlc "$file" 2>/dev/null
+    fi
+
+    echo "$file"
+    for level in 0 1; do
+        compile=`/usr/bin/time -f '%e' ../bin/Z3 -O $level -s 3 a.out 2>&1 >/dev/null`
+        run=`../bin/Z3 -O $level -t a.out 2>/dev/null`
+        echo -en "-O$level:\tcompile "
+        echo -n "`echo "$compile" | tail -n 1`s"
+        echo -en "\trun "
+        echo "$run" | tail -n 1
+    done
+done
+
+rm  a.out "$dir"/*.cm*
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# Run time of each bench at -O1, without and with the profile of a first
+# run, and how much of the code the profile marked cold
+
+dir=./benches
+cd `dirname "$0"`
+for file in `ls $dir/*.ml`; do
+    if [ "$file" = "$dir/mandelbrot.ml" ]; then
+        ocamlc graphics.cma -dllpath /usr/lib/ocaml/stublibs "$file" 2>/dev/null
+    else
+        ocamlc "$file" 2>/dev/null
+    fi
+
+    echo "$file"
+    ../bin/Z3 -O 1 --profile-gen a.prof a.out >/dev/null 2>&1
+    plain=`../bin/Z3 -O 1 -t a.out 2>/dev/null`
+    profiled=`../bin/Z3 -O 1 --profile-use a.prof -t a.out 2>/dev/null`
+    echo -en "plain:\t"
+    echo "$plain" | tail -n 1
+    echo -en "profile:\t"
+    echo "$profiled" | tail -n 1
+    ../bin/Z3 -O 1 --profile-use a.prof -t a.out 2>&1 >/dev/null | grep -E "blocks|cold|weighted"
+done
+
+rm  a.out a.prof "$dir"/*.cm*
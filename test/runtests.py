@@ -20,30 +20,7 @@ def test_fail(test_name, message):
     test_print(colored("Test {1} failed ! {2}".format(test_num, test_name, message), "red"))
 
 
-def compile_and_run(file_path):
-    test_print("Running test {0}".format(file_path))
-
-    clean = False
-    if file_path.find("clean") != -1:
-        clean = True
-
-    try:
-        compile_output = subprocess.check_output(["ocamlc", file_path + ".ml"], stderr=subprocess.STDOUT)
-        if clean:
-            subprocess.check_output(["ocamlclean", "a.out"])
-    except subprocess.CalledProcessError, e:
-        test_fail(file_path, "Compilation error")
-        test_print("Compilation output : ")
-        print e.output
-        raise e
-
-    os.remove(file_path + ".cmo")
-    os.remove(file_path + ".cmi")
-
-    try:
-        options = open(file_path + ".opts").read().split(" ")
-    except IOError:
-        options = []
+def check_run(file_path, clean, options):
     z3_call_vect = [Z3_PATH, "a.out"] + options
 
     try:
@@ -73,6 +50,58 @@ def compile_and_run(file_path):
     except IOError:
         pass
 
+
+def check_sizes(file_path):
+    # Each line of the sizes file is "<minimum> <name>", for a size
+    # reported by -t
+    try:
+        minimums = [line.split(" ", 1) for line in open(file_path + ".sizes").read().splitlines() if line.strip()]
+    except IOError:
+        return
+
+    out = subprocess.check_output([Z3_PATH, "a.out", "-t"], stderr=subprocess.STDOUT)
+    report = out[out.find("\nSizes:\n"):].split("\n\n")[0]
+    sizes = {}
+    for line in report.splitlines()[2:]:
+        name, size = line.rsplit(None, 1)
+        sizes[name.strip()] = int(size)
+
+    for minimum, name in minimums:
+        if sizes.get(name, 0) < int(minimum):
+            test_fail(file_path, "Expected at least {0} {1}, got {2}".format(minimum, name, sizes.get(name, 0)))
+            raise Exception()
+
+
+def compile_and_run(file_path):
+    test_print("Running test {0}".format(file_path))
+
+    clean = False
+    if file_path.find("clean") != -1:
+        clean = True
+
+    try:
+        compile_output = subprocess.check_output(["ocamlc", file_path + ".ml"], stderr=subprocess.STDOUT)
+        if clean:
+            subprocess.check_output(["ocamlclean", "a.out"])
+    except subprocess.CalledProcessError, e:
+        test_fail(file_path, "Compilation error")
+        test_print("Compilation output : ")
+        print e.output
+        raise e
+
+    os.remove(file_path + ".cmo")
+    os.remove(file_path + ".cmi")
+
+    # Each line of the options file is a run of the program
+    try:
+        runs = [line.split() for line in open(file_path + ".opts").read().splitlines() if line.strip()]
+    except IOError:
+        runs = [[]]
+
+    for options in runs:
+        check_run(file_path, clean, options)
+    check_sizes(file_path)
+
     test_print(colored("Test {0} succeeded !".format(file_path), "green"))
 
 
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Average wall time of Z3 running a hello world, mostly spent starting up,
+# next to the one of ocamlrun. The -t report of one run gives the time
+# spent reading StdLib, and how many of its functions were imported.
+
+runs=20
+cd `dirname "$0"`
+echo 'print_string "Hello world\n";;' > hello.ml
+ocamlc hello.ml 2>/dev/null
+
+for vm in ../bin/Z3 ocamlrun; do
+    start=`date +%s.%N`
+    for i in `seq $runs`; do
+        $vm a.out >/dev/null
+    done
+    end=`date +%s.%N`
+    echo "`basename $vm`:	`echo "($end - $start) / $runs" | bc -l`s"
+done
+../bin/Z3 -t a.out 2>&1 >/dev/null | grep StdLib
+
+rm a.out hello.*
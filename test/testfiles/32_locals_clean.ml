@@ -0,0 +1,15 @@
+exception Found of int;;
+
+let rec build n acc = if n = 0 then acc else build (n - 1) (n :: acc);;
+
+let find p l =
+  try List.iter (fun x -> if p x then raise (Found x)) l; -1
+  with Found x -> x
+;;
+
+let l = build 1000 [];;
+
+print_int (List.fold_left (+) 0 l);;
+print_newline ();;
+print_int (find (fun x -> x * x > 500) l);;
+print_newline ();;
@@ -0,0 +1,39 @@
+let f a b =
+  print_int (a + b); print_char ' ';
+  print_int (a - b); print_char ' ';
+  print_int (a * b); print_char ' ';
+  print_int (a / b); print_char ' ';
+  print_int (a mod b); print_char ' ';
+  print_int (a land b); print_char ' ';
+  print_int (a lor b); print_char ' ';
+  print_int (a lxor b); print_char ' ';
+  print_int (a lsl 2); print_char ' ';
+  print_int (a asr 1); print_char ' ';
+  print_string (if a < b then "lt" else if a = b then "eq" else "gt");
+  print_newline ()
+;;
+
+f 17 5;;
+f (-17) 5;;
+print_int (try 1 / 0 with Division_by_zero -> -1);;
+print_newline ();;
+
+(* Results wrap around at 63 bits *)
+let ovf a =
+  print_string (if a + 1 < 0 then "neg" else "pos"); print_char ' ';
+  print_int (a * a); print_char ' ';
+  print_int ((a + 1) / (-1)); print_char ' ';
+  print_int ((a + a) mod 7);
+  print_newline ()
+;;
+
+let hash s n =
+  let rec go i h =
+    if i = String.length s then h mod n
+    else go (i + 1) (h * 31 + Char.code s.[i]) in
+  go 0 0
+;;
+
+ovf max_int;;
+print_int (hash "the quick brown fox jumps over the lazy dog" 1000003);;
+print_newline ();;
@@ -0,0 +1,14 @@
+let sum n =
+  let s = ref 0 in
+  for i = 1 to n do s := !s + i * i done;
+  !s
+;;
+
+let rec count_down n acc =
+  if n = 0 then acc else count_down (n - 1) (acc + n mod 7)
+;;
+
+print_int (sum 1000);;
+print_newline ();;
+print_int (count_down 10000 0);;
+print_newline ();;
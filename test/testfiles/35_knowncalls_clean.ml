@@ -0,0 +1,17 @@
+let rec is_even n = if n = 0 then true else is_odd (n - 1)
+and is_odd n = if n = 0 then false else is_even (n - 1)
+;;
+
+let add3 a b c = a + b + c;;
+
+let apply_twice n =
+  let double x = x * 2 in
+  double (double n)
+;;
+
+print_string (if is_even 1000 then "even" else "odd");;
+print_newline ();;
+let add1 = add3 1 in print_int (add1 2 3);;
+print_newline ();;
+print_int (apply_twice 21);;
+print_newline ();;
@@ -0,0 +1,26 @@
+let add a b = a + b;;
+
+let rec fact n = if n = 0 then 1 else n * fact (n - 1);;
+
+let make_adder n = fun x -> x + n;;
+
+let apply f x = f x;;
+
+let compute n =
+  let sq x = x * x in
+  let rec go i acc = if i > n then acc else go (i + 1) (acc + sq i) in
+  go 1 0
+;;
+
+let over n = make_adder n 2;;
+
+print_int (add 20 22);;
+print_newline ();;
+print_int (fact 10);;
+print_newline ();;
+print_int (over 1);;
+print_newline ();;
+let add5 = add 5 in print_int (apply add5 10);;
+print_newline ();;
+print_int (compute 10);;
+print_newline ();;
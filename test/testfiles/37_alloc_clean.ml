@@ -0,0 +1,30 @@
+type point = { x : int; y : int; z : int; w : int; name : string };;
+type fpoint = { fx : float; fy : float };;
+
+let rec build n acc = if n = 0 then acc else build (n - 1) (n :: acc);;
+let rec sum l acc = match l with [] -> acc | h :: t -> sum t (acc + h);;
+
+let make_points n =
+  let rec go i acc =
+    if i = n then acc
+    else go (i + 1) ({ x = i; y = i * 2; z = i * 3; w = i * 4; name = "p" } :: acc) in
+  go 0 []
+;;
+let rec total l acc = match l with [] -> acc | p :: t -> total t (acc + p.x + p.y + p.z + p.w);;
+
+let adders n =
+  let rec go i acc = if i = n then acc else go (i + 1) ((fun x -> x + i) :: acc) in
+  go 0 []
+;;
+let rec apply_all l v = match l with [] -> v | f :: t -> apply_all t (f v);;
+
+let fp = { fx = 1.5; fy = 2.5 };;
+
+print_int (sum (build 100000 []) 0);;
+print_newline ();;
+print_int (total (make_points 10000) 0);;
+print_newline ();;
+print_int (apply_all (adders 1000) 0);;
+print_newline ();;
+print_int (int_of_float (fp.fx +. fp.fy));;
+print_newline ();;
@@ -0,0 +1,25 @@
+type tree = Leaf | Node of tree * int * tree;;
+
+let rec build d =
+  if d = 0 then Leaf
+  else
+    let l = build (d - 1) in
+    let r = build (d - 1) in
+    Node (l, d, r)
+;;
+
+let rec count t = match t with
+  | Leaf -> 0
+  | Node (l, _, r) -> count l + 1 + count r
+;;
+
+let rec weight t = match t with
+  | Leaf -> 0
+  | Node (l, d, r) -> weight l + d + weight r
+;;
+
+let t = build 18;;
+print_int (count t);;
+print_newline ();;
+print_int (weight (build 12) + weight t);;
+print_newline ();;
@@ -0,0 +1,30 @@
+exception Found of int;;
+
+let rec nest n =
+  if n = 0 then raise (Found 0)
+  else try nest (n - 1) with Found k -> raise (Found (k + 1))
+;;
+
+let safe_div a b = try a / b with Division_by_zero -> -1;;
+
+let first l = try List.hd l with Failure _ -> 0;;
+
+let rec count n acc =
+  if n = 0 then acc
+  else count (n - 1) (try acc + (if n mod 3 = 0 then raise Exit else 1) with Exit -> acc)
+;;
+
+(try nest 5000 with Found k -> print_int k);;
+print_newline ();;
+print_int (safe_div 10 0);;
+print_newline ();;
+print_int (safe_div 10 3);;
+print_newline ();;
+print_int (first []);;
+print_newline ();;
+print_int (first [7; 8]);;
+print_newline ();;
+print_int (count 100000 0);;
+print_newline ();;
+print_int (try int_of_string "z3" with Failure _ -> 42);;
+print_newline ();;
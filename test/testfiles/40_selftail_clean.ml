@@ -0,0 +1,20 @@
+let rec gcd a b = if b = 0 then a else gcd b (a mod b);;
+
+let rec sum_to n acc = if n = 0 then acc else sum_to (n - 1) (acc + n);;
+
+let rec iter z_re z_im c_re c_im n =
+  if n = 0 then 0
+  else if z_re * z_re + z_im * z_im > 4000000 then n
+  else iter ((z_re * z_re - z_im * z_im) / 1000 + c_re) (2 * z_re * z_im / 1000 + c_im) c_re c_im (n - 1)
+;;
+
+let rec length_acc l acc = match l with [] -> acc | _ :: t -> length_acc t (acc + 1);;
+
+print_int (gcd 1071 462);;
+print_newline ();;
+print_int (sum_to 10000000 0);;
+print_newline ();;
+print_int (iter 0 0 (-750) 100 50);;
+print_newline ();;
+print_int (length_acc [1; 2; 3; 4; 5] 0);;
+print_newline ();;
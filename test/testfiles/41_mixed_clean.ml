@@ -0,0 +1,31 @@
+exception Found of int;;
+
+let rec fib n = if n < 2 then n else fib (n - 1) + fib (n - 2);;
+
+let add a b c = a + b + c;;
+
+let rec map f l = match l with [] -> [] | h :: t -> f h :: map f t;;
+
+let rec sum l = match l with [] -> 0 | h :: t -> h + sum t;;
+
+let find x l =
+  try List.iter (fun y -> if y = x then raise (Found y)) l; -1
+  with Found y -> y * 10
+;;
+
+let loop n =
+  let r = ref 0 in
+  for i = 1 to n do r := !r + i done;
+  !r
+;;
+
+print_int (fib 20);;
+print_newline ();;
+print_int (sum (map (add 1 2) [1; 2; 3; 4]));;
+print_newline ();;
+for i = 0 to 5 do print_int (find i [1; 3; 5]); print_char ' ' done;;
+print_newline ();;
+print_int (loop 1000);;
+print_newline ();;
+print_int (try fib (raise (Found 7)) with Found n -> n);;
+print_newline ();;
@@ -0,0 +1,12 @@
+exception Negative;;
+
+let rec fact n = if n < 0 then raise Negative else if n = 0 then 1 else n * fact (n - 1);;
+
+let apply f l = List.map f l;;
+
+print_int (fact 10);;
+print_newline ();;
+List.iter (fun x -> print_int x; print_char ' ') (apply (fun x -> x * x) [1; 2; 3]);;
+print_newline ();;
+print_string (try string_of_int (fact (-1)) with Negative -> "negative");;
+print_newline ();;
@@ -0,0 +1,12 @@
+let rec collatz n steps = if n = 1 then steps else if n mod 2 = 0 then collatz (n / 2) (steps + 1) else collatz (3 * n + 1) (steps + 1);;
+
+let longest = ref 0;;
+for i = 1 to 1000 do
+  let s = collatz i 0 in
+  if s > !longest then longest := s
+done;;
+
+print_int !longest;;
+print_newline ();;
+print_int (List.fold_left (fun a x -> a + collatz x 0) 0 [3; 7; 27]);;
+print_newline ();;
@@ -0,0 +1,34 @@
+let x = 3 + 4 * 5;;
+
+let f a =
+  let b = 7 in
+  let c = b * 2 in
+  if c = 14 then a + c else a - c;;
+
+let g n =
+  let k = 10 in
+  let r = ref 0 in
+  for i = 1 to n do r := !r + k / 3 + (k lsl 2) - (-k asr 1) done;
+  !r;;
+
+let h b = if not true then 0 else if b then 1 else 2;;
+
+print_int x;;
+print_newline ();;
+print_int (f 1);;
+print_newline ();;
+print_int (g 4);;
+print_newline ();;
+print_int (h false);;
+print_newline ();;
+print_int (List.length [1; 2; 3] + String.length "abcd");;
+print_newline ();;
+
+(* Copies of values that are not constants *)
+let pair x = (x, x);;
+let twice x = let y = x in y ^ x;;
+
+let (a, b) = pair (List.length [1; 2]) in print_int (a + b);;
+print_newline ();;
+print_string (twice (String.make 2 'z'));;
+print_newline ();;
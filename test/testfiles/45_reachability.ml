@@ -0,0 +1,11 @@
+let table = Hashtbl.create 16;;
+List.iter (fun (k, v) -> Hashtbl.add table k v) [("a", 1); ("b", 2); ("c", 3)];;
+
+let handler = ref (fun x -> x);;
+handler := (fun x -> x * 10);;
+
+let total = Hashtbl.fold (fun _ v acc -> acc + !handler v) table 0;;
+let s = String.concat "," (List.map string_of_int (List.sort compare [3; 1; 2]));;
+let n = try int_of_string "x" with Failure _ -> -1;;
+
+Printf.printf "%d %s %d\n" total s n;;
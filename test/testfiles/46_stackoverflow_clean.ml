@@ -0,0 +1,11 @@
+let rec depth n = if n = 0 then 0 else 1 + depth (n - 1);;
+
+(* Small ZAM stack, so that it overflows before the C stack *)
+Gc.set { (Gc.get ()) with Gc.stack_limit = 32768 };;
+
+print_int (depth 10000);;
+print_newline ();;
+print_string (try string_of_int (depth 10000000) with Stack_overflow -> "Stack_overflow");;
+print_newline ();;
+print_int (depth 10000);;
+print_newline ();;